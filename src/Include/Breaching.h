@@ -1,6 +1,7 @@
 #pragma once
 
 #include "HeightField.h"
+#include "RadixHeap.h"
 
 namespace mmv
 {
@@ -37,11 +38,48 @@ namespace mmv
 
     using ZPriorityQueue = std::priority_queue<Element, std::vector<Element>, comp>;
 
-    enum LindsayMode
+    //! Same order as ZPriorityQueue on packed keys, order_key(elevation) << 32 | (x * ny + y),
+    //! held in a radix heap.
+    //!
+    //! Entering a depression, the Priority-Flood pushes cells lower than the last popped one. They
+    //! go to a small binary heap, drained first: they are lower than anything in the radix heap.
+    class ZRadixQueue
     {
-        COMPLETE_BREACHING,
-        SELECTIVE_BREACHING,
-        CONSTRAINED_BREACHING
+    public:
+        explicit ZRadixQueue(int ny) : m_Ny(ny) {}
+
+        inline bool empty() const { return m_Below.empty() && m_Heap.empty(); }
+
+        inline std::size_t size() const { return m_Below.size() + m_Heap.size(); }
+
+        inline void emplace(scalar_t elevation, const IPoint2 &p)
+        {
+            const std::uint64_t key = std::uint64_t(order_key(elevation)) << 32 | std::uint32_t(p.x() * m_Ny + p.y());
+            if (key < m_Heap.last())
+                m_Below.push(key);
+            else
+                m_Heap.push(key);
+        }
+
+        inline Element top()
+        {
+            const std::uint64_t key = m_Below.empty() ? m_Heap.top() : m_Below.top();
+            const int index = int(key & 0xffffffffu);
+            return {order_value(std::uint32_t(key >> 32)), IPoint2(index / m_Ny, index % m_Ny)};
+        }
+
+        inline void pop()
+        {
+            if (m_Below.empty())
+                m_Heap.pop();
+            else
+                m_Below.pop();
+        }
+
+    private:
+        int m_Ny;
+        RadixHeap m_Heap;
+        std::priority_queue<std::uint64_t, std::vector<std::uint64_t>, std::greater<std::uint64_t>> m_Below;
     };
 
     enum LindsayCellType
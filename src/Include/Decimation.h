@@ -0,0 +1,25 @@
+#pragma once
+
+#include "pch.h"
+
+#include "Type.h"
+
+namespace mmv
+{
+    //! Quadric error metric simplification (Garland & Heckbert 1997) of an indexed triangle mesh, in place.
+    //!
+    //! Edges are collapsed cheapest first from a heap, the merged vertex moves to the point minimizing the
+    //! quadric of both ends. Collapses folding a triangle over or pinching the mesh are skipped.
+    //!
+    //! The mesh is cut into tiles of about tile_triangles triangles along x and z, simplified in parallel:
+    //! the vertices on the borders of the tiles, and of the mesh, are locked. Passes alternate with tiles
+    //! shifted by half a tile, which simplify the borders of the previous ones. The mesh must be
+    //! manifold, like the grids of Polygonize.
+    //!
+    //! Stops at max_triangles triangles (0: no budget), or when the next collapse would move the surface
+    //! more than max_error (0: no tolerance): the error of a vertex is the root mean square distance to the
+    //! planes of the original triangles merged into it, weighted by their area. The unused vertices are
+    //! removed. Returns the number of triangles left.
+    std::size_t decimate(std::vector<vec3> &positions, std::vector<unsigned> &indices, std::size_t max_triangles,
+                         scalar_t max_error = 0.f, int tile_triangles = 1 << 18);
+} // namespace mmv
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "pch.h"
+
+#include "Type.h"
+
+//! D8 flow routing on a row-major nx * ny grid.
+//!
+//! Every cell drains into a single receiver, its steepest downslope neighbour (8-connexity).
+//! Cells of a flat with an outlet drain across it, following a gradient computed without
+//! touching the elevations. Pits, closed flats and the cells on the border of the grid are
+//! their own receiver: they are the outlets of the network. The receivers form a forest, so
+//! drainage quantities can be propagated in a single linear pass over a topological order
+//! of the cells.
+namespace flow
+{
+    //! Evaluation on the calling thread, or split over the ThreadPool.
+    enum class Execution
+    {
+        SEQUENTIAL,
+        PARALLEL
+    };
+
+    //! Single (D8) or multiple flow directions: MFD spreads the flow over every lower neighbour
+    //! (Quinn/Freeman), DINF over the two neighbours of the steepest triangular facet (Tarboton).
+    enum class Mode
+    {
+        D8,
+        MFD,
+        DINF
+    };
+
+    //! Receivers, donor counts and topological order of a grid.
+    struct Routing
+    {
+        int nx{0}, ny{0};
+        std::vector<index_t> receivers;     //! receivers[i] == i for outlets
+        std::vector<int> donors;            //! Number of cells draining into each cell
+        std::vector<std::uint8_t> upstream; //! Bit n set when the n-th neighbour drains into the cell
+        std::vector<index_t> order;         //! Every cell appears before its receiver (schedule dependent when built in parallel)
+    };
+
+    //! Steepest descent receiver of every cell, (cx, cy) being the size of a cell.
+    void d8_receivers(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, index_t *receivers,
+                      Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Flat resolution (Barnes, Lehman, Mulla 2014): labels of the flats draining through a cell at the
+    //! same elevation (0 elsewhere) and, over each flat, a mask combining twice the breadth-first distance
+    //! to the lower terrain with the distance away from the higher terrain. Near linear time: the
+    //! plateaus are labelled with a lock-free union-find and the breadth-first passes run flat by flat,
+    //! split over the pool by the parallel policy. Both policies give the same labels and mask.
+    void flat_mask(const scalar_t *h, int nx, int ny, const index_t *receivers, std::vector<int> &labels, std::vector<int> &mask,
+                   Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Give the cells of the flats with an outlet the receiver of lowest mask, leaving the elevations
+    //! untouched. The mask strictly decreases towards the outlet, so no cycle can appear. Returns right
+    //! away when no interior cell is its own receiver.
+    void resolve_flats(const scalar_t *h, int nx, int ny, index_t *receivers, Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Number of donors of every cell and the matching neighbour masks, outlets do not count themselves.
+    void donor_counts(const index_t *receivers, int nx, int ny, int *donors, std::uint8_t *upstream,
+                      Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Upstream to downstream order, starting from the cells without donors. The sequential
+    //! order is Kahn's (deterministic), the parallel one follows the thread schedule. With a
+    //! single thread available, the parallel policy takes the sequential path.
+    void topological_order(const index_t *receivers, const int *donors, int n, index_t *order,
+                           Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Compute the whole routing of a grid, flats resolved, reusing the allocations of routing.
+    void route(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, Routing &routing,
+               Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Add the values of the donors of every cell to its own once they are final: values[i]
+    //! then holds the sum over the cells draining through i (itself included). Donors are
+    //! summed in neighbour order, so both policies give bit-identical results.
+    //! The parallel policy propagates with atomic donor counters and does not use the order,
+    //! unless a single thread is available.
+    void accumulate(const Routing &routing, scalar_t *values, Execution policy = Execution::SEQUENTIAL, int threads = 0);
+
+    //! Cells sorted by decreasing elevation, equal elevations by increasing index (radix sort).
+    void elevation_order(const scalar_t *h, int n, std::vector<index_t> &order);
+
+    //! Spread the value of every cell over its lower neighbours in proportion to L * tan(b)^exponent,
+    //! L being the contour length and tan(b) the slope towards the neighbour (Quinn, or Freeman with
+    //! exponent 1.1). A cell is spread once all its higher neighbours are, walking downstream from the
+    //! cells without higher neighbours: no elevation order is needed. Border cells are outlets.
+    void accumulate_mfd(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, scalar_t *values, scalar_t exponent = 1.f);
+
+    //! Spread the value of every cell over the two neighbours of its steepest facet, in proportion to
+    //! the angle of the flow direction (D-infinity), cells being visited in the given elevation order.
+    //! Facets whose cardinal neighbour is higher do not compete; a cell left without any facet, at the
+    //! bottom of a one cell wide diagonal valley, drains along its steepest diagonal.
+    void accumulate_dinf(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, const index_t *order, scalar_t *values);
+} // namespace flow
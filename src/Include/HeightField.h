@@ -2,8 +2,10 @@
 
 #include "pch.h"
 
+#include "Flow.h"
 #include "ImageUtils.h"
 #include "Memory.h"
+#include "RTIN.h"
 
 using pixel_t = unsigned char;
 using scalar_t = float;
@@ -43,12 +45,14 @@ namespace mmv
         inline T &operator()(index_t i, index_t j)
         {
             assert(InBounds(i, j));
+            Touch();
             return m_Elements[j * m_Nx + i];
         }
 
         inline T &operator()(index_t i)
         {
             assert(InBounds(i));
+            Touch();
             return m_Elements[i];
         }
 
@@ -65,6 +69,15 @@ namespace mmv
             return m_Elements[i];
         }
 
+        //! Raw access to the row-major elements.
+        inline T *Data()
+        {
+            Touch();
+            return m_Elements.data();
+        }
+
+        inline const T *Data() const { return m_Elements.data(); }
+
         inline index_t OneDIndex(index_t i, index_t j) const
         {
             assert(InBounds(i, j));
@@ -92,9 +105,41 @@ namespace mmv
             return std::min(h, std::max(l, m_Elements[j * m_Nx + i]));
         }
 
-        void Smooth();
-        void Blur();
-        void Gauss();
+        //! Resize the grid and fill it with v, reusing the current allocation when possible.
+        inline void Resize(int nx, int ny, T v = 0)
+        {
+            m_Nx = nx;
+            m_Ny = ny;
+            m_Elements.assign(nx * ny, v);
+            m_Min = v;
+            m_Max = v;
+            Touch();
+        }
+
+        //! Mark the elements as modified, invalidating everything derived from them.
+        inline void Touch() { ++m_Version; }
+
+        //! Modification counter, incremented each time the elements may have changed.
+        inline std::uint64_t Version() const { return m_Version; }
+
+        //! Separable filters, see kernel:: in ImageUtils.h.
+        void Smooth(BorderMode mode = BorderMode::CLAMP);
+        void Smooth(int iterations, BorderMode mode = BorderMode::CLAMP);
+        void Blur(BorderMode mode = BorderMode::CLAMP);
+        void Gauss(BorderMode mode = BorderMode::CLAMP);
+
+        //! Gaussian blur of standard deviation sigma (in cells).
+        void Gauss(scalar_t sigma, BorderMode mode = BorderMode::CLAMP);
+
+        //! Convolve rows and columns with the centred 1D kernel k (odd size).
+        void Convolve(const std::vector<float> &k, BorderMode mode = BorderMode::CLAMP);
+        void Convolve(const float *k, int r, BorderMode mode = BorderMode::CLAMP);
+
+        //! Box filter of (2 * radius + 1)^2 cells, constant cost per cell whatever the radius.
+        void BoxBlur(int radius, BorderMode mode = BorderMode::CLAMP);
+
+        //! Gaussian blur, recursive (constant cost per cell) from sigma = 6, the direct kernel below.
+        void RecursiveGauss(scalar_t sigma, BorderMode mode = BorderMode::CLAMP);
 
         //! Getters
         inline int Nx() const { return m_Nx; }
@@ -128,32 +173,74 @@ namespace mmv
 
         int m_Nx{10}, m_Ny{10}; //! Resolution on x & y
 
+        std::uint64_t m_Version{0};
+
+        std::vector<T> m_Scratch{}; //! Reused by the filters, never holds elements between calls
+
     private:
         scalar_t m_Min, m_Max;
     };
 
     template <typename T>
-    inline void Array2<T>::Smooth()
+    inline void Array2<T>::Smooth(BorderMode mode)
+    {
+        Convolve(kernel::smooth, kernel::smooth_radius, mode);
+    }
+
+    template <typename T>
+    inline void Array2<T>::Smooth(int iterations, BorderMode mode)
+    {
+        convolve_iterated(m_Elements.data(), m_Nx, m_Ny, kernel::smooth, kernel::smooth_radius, iterations, mode, m_Scratch);
+        Touch();
+    }
+
+    template <typename T>
+    inline void Array2<T>::Blur(BorderMode mode)
+    {
+        Convolve(kernel::blur, kernel::blur_radius, mode);
+    }
+
+    template <typename T>
+    inline void Array2<T>::Gauss(BorderMode mode)
+    {
+        Convolve(kernel::gauss, kernel::gauss_radius, mode);
+    }
+
+    template <typename T>
+    inline void Array2<T>::Gauss(scalar_t sigma, BorderMode mode)
+    {
+        Convolve(kernel::gaussian(sigma), mode);
+    }
+
+    template <typename T>
+    inline void Array2<T>::Convolve(const std::vector<float> &k, BorderMode mode)
+    {
+        assert(k.size() % 2 == 1);
+        Convolve(k.data(), int(k.size()) / 2, mode);
+    }
+
+    template <typename T>
+    inline void Array2<T>::Convolve(const float *k, int r, BorderMode mode)
     {
-        std::vector<scalar_t> output(m_Nx * m_Ny);
-        convolve(m_Elements, output, m_Nx, m_Ny, kernel::smooth, kernel::smooth_size);
-        m_Elements = output;
+        //! Rows into the scratch buffer, then columns back into the elements
+        m_Scratch.resize(m_Elements.size());
+        convolve_rows(m_Elements.data(), m_Scratch.data(), m_Nx, m_Ny, k, r, mode);
+        convolve_columns(m_Scratch.data(), m_Elements.data(), m_Nx, m_Ny, k, r, mode);
+        Touch();
     }
 
     template <typename T>
-    inline void Array2<T>::Blur()
+    inline void Array2<T>::BoxBlur(int radius, BorderMode mode)
     {
-        std::vector<scalar_t> output(m_Nx * m_Ny);
-        convolve(m_Elements, output, m_Nx, m_Ny, kernel::blur, kernel::blur_size);
-        m_Elements = output;
+        box_filter(m_Elements.data(), m_Elements.data(), m_Nx, m_Ny, radius, mode);
+        Touch();
     }
 
     template <typename T>
-    inline void Array2<T>::Gauss()
+    inline void Array2<T>::RecursiveGauss(scalar_t sigma, BorderMode mode)
     {
-        std::vector<scalar_t> output(m_Nx * m_Ny);
-        convolve(m_Elements, output, m_Nx, m_Ny, kernel::gauss, kernel::gauss_size);
-        m_Elements = output;
+        recursive_gaussian(m_Elements.data(), m_Elements.data(), m_Nx, m_Ny, sigma, mode);
+        Touch();
     }
 
     class ScalarField : public Array2<scalar_t>
@@ -183,18 +270,39 @@ namespace mmv
         //! Get height of a point within the scalar field.
         scalar_t Height(const vec2 &point) const;
 
-        //! Compute gradient at a point with position (i [col], j [row]).
+        //! Compute gradient at a point with position (i [col], j [row]), in height per cell: half the
+        //! difference of the two neighbours, one-sided on the borders, not divided by the cell size.
         vec2 Gradient(index_t i, index_t j) const;
 
-        //! Compute gradient for a given point with 2D coordinates (x, y).
+        //! Compute gradient for a given point with 2D coordinates (x, y): the per cell gradients of the
+        //! four surrounding cells, interpolated bilinearly. Points outside the grid take the border value.
         vec2 Gradient(scalar_t x, scalar_t y) const;
 
-        //! Compute laplacian at a point with position (i [col], j [row]).
+        //! Compute laplacian at a point with position (i [col], j [row]), in height per cell squared.
         scalar_t Laplacian(index_t i, index_t j) const;
 
-        //! Compute laplacian for a given point with 2D coordinates (x, y).
+        //! Compute laplacian for a given point with 2D coordinates (x, y), sampled as Gradient(x, y).
         scalar_t Laplacian(scalar_t x, scalar_t y) const;
 
+        //! Cached gradient layers (x & y components), recomputed after any modification.
+        const Array2 &GradientsX() const;
+        const Array2 &GradientsY() const;
+
+        //! Cached laplacian layer, recomputed after any modification.
+        const Array2 &Laplacians() const;
+
+        //! Write the elevations as a grayscale image into a caller-owned buffer.
+        void ElevationImage(ImageData &image, int nx = -1, int ny = -1);
+
+        //! Write the gradient values into a caller-owned image buffer.
+        void GradientImage(ImageData &image, int nx = -1, int ny = -1) const;
+
+        //! Write the (signed square rooted) laplacian values into a caller-owned grid.
+        void LaplacianMap(Array2 &values, int nx = -1, int ny = -1) const;
+
+        //! Write the laplacian values as a grayscale image into a caller-owned buffer.
+        void LaplacianImage(ImageData &image, int nx = -1, int ny = -1) const;
+
         //! Save the elevations of a scalarfield as a grayscale image.
         int ExportElevation(const std::string &filename, int nx = -1, int ny = -1);
 
@@ -208,14 +316,47 @@ namespace mmv
         int ExportElevationAsTxt(const std::string &filename, int nx = -1, int ny = -1);
 
     protected:
+        //! Bilinear interpolation of a layer at a point of coordinates (x, y) in 2D.
+        scalar_t Sample(const Array2 &layer, scalar_t x, scalar_t y) const;
+
+        void UpdateGradients() const;
+        void UpdateLaplacians() const;
+
+        void GrayscaleImage(ImageData &image, const Array2 &values) const;
+
         int ExportGrayscaleImage(const std::string &filename, const int nx, const int ny, const Array2 &values) const;
 
     protected:
         vec2 m_Diag{};
+
+        static constexpr std::uint64_t s_Dirty = std::numeric_limits<std::uint64_t>::max();
+
+        //! Derivative caches, tagged with the version of the elevations they were computed from.
+        mutable Array2 m_GradientsX{}, m_GradientsY{}, m_Laplacians{};
+        mutable std::uint64_t m_GradientsVersion{s_Dirty}, m_LaplaciansVersion{s_Dirty};
     } typedef SF;
 
     std::vector<scalar_t> load_elevation(const std::string& map);
 
+    //! COMPLETE_BREACHING breaches every depression. SELECTIVE_BREACHING only breaches the paths within
+    //! the depth and length limits, CONSTRAINED_BREACHING also carves the paths deeper than the depth
+    //! limit by the limit at most. What is left is filled.
+    enum LindsayMode
+    {
+        COMPLETE_BREACHING,
+        SELECTIVE_BREACHING,
+        CONSTRAINED_BREACHING
+    };
+
+    //! Meshes of ExportObj: the uniform grid of Polygonize, the RTIN of PolygonizeAdaptive, or the
+    //! grid simplified by PolygonizeDecimated.
+    enum MeshMode
+    {
+        UNIFORM_MESH,
+        ADAPTIVE_MESH,
+        DECIMATED_MESH
+    };
+
     class HeightField : public ScalarField
     {
     public:
@@ -232,16 +373,38 @@ namespace mmv
         //! Return a mesh of the HF.
         Mesh Polygonize(int resolution) const;
 
+        //! Vertex attributes of the resolution^2 grid of Polygonize, packed as floats (xyz, xyz, uv).
+        //! The texcoords only depend on the resolution, they are left alone when texcoords is null.
+        void PolygonizeVertices(int resolution, std::vector<float> &positions, std::vector<float> &normals, std::vector<float> *texcoords = nullptr) const;
+
+        //! Two triangles per quad of a resolution^2 vertex grid, the same for every HF of that resolution.
+        static void GridIndices(int resolution, std::vector<unsigned> &indices);
+
+        //! Adaptive mesh of the HF at full resolution, vertical error at most max_error (RTIN).
+        Mesh PolygonizeAdaptive(scalar_t max_error) const;
+
+        //! Vertex attributes and triangles of PolygonizeAdaptive, packed as floats (xyz, xyz, uv).
+        void PolygonizeAdaptive(scalar_t max_error, std::vector<float> &positions, std::vector<float> &normals, std::vector<float> &texcoords,
+                                std::vector<unsigned> &indices) const;
+
+        //! Mesh of Polygonize(resolution) simplified by quadric error (see decimate) down to max_triangles
+        //! (0: no budget), or until the surface moves by max_error (0: no tolerance). The normals are
+        //! resampled at the vertices left.
+        Mesh PolygonizeDecimated(int resolution, std::size_t max_triangles, scalar_t max_error = 0.f) const;
+
+        //! Cached error hierarchy of the adaptive meshes, recomputed after any modification.
+        const RTIN &AdaptiveHierarchy() const;
+
         //! Compute the normal vector at point of coordinates (i [col], j [row]) in the grid.
         Vector Normal(index_t i, index_t j) const;
 
-        //! Compute the normal vector for a given point of coordinates (x, y) in 2D.
+        //! Compute the normal vector for a given point of coordinates (x, y) in 2D, from Gradient(x, y).
         Vector Normal(scalar_t x, scalar_t y) const;
 
         //! Compute the slope at point of coordinates (i [col], j [row]) in the grid.
         scalar_t Slope(index_t i, index_t j) const;
 
-        //! Compute the slope for a given point of coordinates (x, y) in 2D.
+        //! Compute the slope for a given point of coordinates (x, y) in 2D, from Gradient(x, y).
         scalar_t Slope(scalar_t x, scalar_t y) const;
 
         //! Compute the average slope (8-connexity) for a given point (i [col], j [row]) in the grid.
@@ -250,6 +413,39 @@ namespace mmv
         //! Compute the average slope (8-connexity) for a given point of coordinates (x, y) in 2D.
         scalar_t AverageSlope(scalar_t x, scalar_t y) const;
 
+        //! Cached slope layer, recomputed after any modification.
+        const Array2 &Slopes() const;
+
+        //! Cached average slope layer, recomputed after any modification.
+        const Array2 &AverageSlopes() const;
+
+        //! Fill caller-owned grids with the normal components of every cell.
+        void Normals(Array2 &x, Array2 &y, Array2 &z) const;
+
+        //! Write the normals into a caller-owned image buffer.
+        void NormalImage(ImageData &image, int nx = -1, int ny = -1) const;
+
+        //! Write the (square rooted) slopes into a caller-owned grid.
+        void SlopeMap(Array2 &values, int nx = -1, int ny = -1) const;
+
+        //! Write the slopes as a grayscale image into a caller-owned buffer.
+        void SlopeImage(ImageData &image, int nx = -1, int ny = -1) const;
+
+        //! Write the (square rooted) average slopes into a caller-owned grid.
+        void AverageSlopeMap(Array2 &values, int nx = -1, int ny = -1) const;
+
+        //! Write the average slopes as a grayscale image into a caller-owned buffer.
+        void AverageSlopeImage(ImageData &image, int nx = -1, int ny = -1) const;
+
+        //! Write the shading for a given light direction into a caller-owned grid.
+        void ShadingMap(Array2 &values, const Vector &light_direction, int nx = -1, int ny = -1) const;
+
+        //! Write the shading as a grayscale image into a caller-owned buffer.
+        void ShadingImage(ImageData &image, const Vector &light_direction, int nx = -1, int ny = -1) const;
+
+        //! Write the stream area into a caller-owned image buffer (Nx * Ny).
+        void StreamAreaImage(ImageData &image, flow::Mode mode = flow::Mode::D8) const;
+
         //! Save an image of the normals.
         int ExportNormal(const std::string &filename, int nx = -1, int ny = -1) const;
 
@@ -264,17 +460,79 @@ namespace mmv
 
         int ExportGlobalShading(const std::string &filename, int ppp = 10, int nx = -1, int ny = -1) const;
 
-        //! Export the Height Field as an OBJ.
-        int ExportObj(const std::string &filename, int resolution);
+        //! Export the Height Field as an OBJ. ADAPTIVE_MESH ignores resolution and max_triangles, UNIFORM_MESH
+        //! ignores both max_error and max_triangles.
+        int ExportObj(const std::string &filename, int resolution, MeshMode mode = UNIFORM_MESH, scalar_t max_error = 0.f,
+                      std::size_t max_triangles = 0) const;
+
+        int ExportStreamArea(const std::string &filename, flow::Mode mode = flow::Mode::D8) const;
+
+        //! Cached D8 flow routing (receivers, donor counts and order), recomputed after any modification.
+        const flow::Routing &FlowRouting(flow::Execution policy = flow::Execution::SEQUENTIAL) const;
+
+        //! Cached indices of the cells by decreasing elevation, recomputed after any modification.
+        const std::vector<index_t> &ElevationOrder() const;
+
+        //! Drainage area of every cell in number of cells. D8 is accumulated in linear time over the
+        //! routing (both policies give the same areas), MFD walks downstream from the cells without
+        //! higher neighbours and DINF follows the elevation order.
+        Array2 StreamArea(flow::Mode mode = flow::Mode::D8, flow::Execution policy = flow::Execution::SEQUENTIAL) const;
+
+        //! Cached stream area of the last mode asked for, recomputed after any modification or change of mode.
+        const Array2 &StreamAreas(flow::Mode mode = flow::Mode::D8) const;
+
+        //! Breach the depressions (Lindsay 2016). Outside COMPLETE_BREACHING, breach paths are searched
+        //! over max_length cells at most and carved max_depth deep at most, the remaining depressions are
+        //! filled with an epsilon gradient if fill_depressions is set.
+        void CompleteBreach(LindsayMode mode = COMPLETE_BREACHING,
+                            scalar_t max_depth = std::numeric_limits<scalar_t>::max(),
+                            int max_length = std::numeric_limits<int>::max(),
+                            bool fill_depressions = true);
+
+        //! Fill the depressions with an epsilon gradient (Priority-Flood+epsilon, FIFO for depression cells).
+        void FillDepressions();
+
+        //! Fill the depressions with the tiled Priority-Flood (Barnes 2016), tiles of tile_size^2 cells
+        //! flooded in parallel. Same result as a serial Priority-Flood, depressions are left flat.
+        //! There is no tiled breaching: a fill only needs the spill level of every watershed, which the
+        //! graph of spill elevations between tiles gives, while a breach path runs back from the pit to
+        //! its outlet across any number of tiles, and where it stops depends on the paths drilled before
+        //! it in the global flood order.
+        void FillDepressionsTiled(int tile_size = 1024, int threads = 0);
+
+        //! One implicit step of the stream power law dh/dt = uplift - k * A^m * S^n (Braun & Willett 2013),
+        //! A being the D8 drainage area in cells and S the slope towards the receiver. Unconditionally
+        //! stable for n = 1, so dt can be large. Border cells are fixed base levels.
+        void StreamPower(scalar_t uplift = 0.f, scalar_t k = 0.1f, scalar_t m = 0.5f, scalar_t n = 1.f, scalar_t dt = 1.f);
+
+    private:
+        //! Fill the vertices of Polygonize, rows in parallel. Texcoords are skipped when null.
+        void PolygonizeRows(int n, float *positions, float *normals, float *texcoords) const;
+
+        //! Fill the vertices of PolygonizeAdaptive, given their grid indices.
+        void AdaptiveVertices(const std::vector<index_t> &vertices, float *positions, float *normals, float *texcoords) const;
+
+    private:
+        mutable Array2 m_Slopes{}, m_AverageSlopes{};
+        mutable std::uint64_t m_SlopesVersion{s_Dirty}, m_AverageSlopesVersion{s_Dirty};
 
-        int ExportStreamArea(const std::string &filename) const;
+        mutable flow::Routing m_Routing{};
+        mutable std::uint64_t m_RoutingVersion{s_Dirty};
 
-        Array2 StreamArea() const;
+        mutable Array2 m_StreamAreas{};
+        mutable std::uint64_t m_StreamAreasVersion{s_Dirty};
+        mutable flow::Mode m_StreamAreasMode{flow::Mode::D8};
 
-        void CompleteBreach();
+        mutable std::vector<index_t> m_ElevationOrder{};
+        mutable std::uint64_t m_ElevationOrderVersion{s_Dirty};
 
-        void StreamPower();
+        mutable RTIN m_Adaptive{};
+        mutable std::uint64_t m_AdaptiveVersion{s_Dirty};
 
+        //! Scratch of the breaching and filling, kept from one call to the next: one packed state per cell
+        //! and the flood order when the depressions are filled after breaching.
+        std::vector<std::uint8_t> m_BreachingCells{};
+        std::vector<index_t> m_FloodOrder{};
     } typedef HF;
 
     //! Generate a random direction on an hemisphere
@@ -4,30 +4,61 @@
 
 #include "Type.h"
 
+//! How samples outside of the grid are read by the convolution.
+enum class BorderMode
+{
+    CLAMP,  //! Repeat the edge cell: aa|abcd|dd
+    MIRROR, //! Reflect around the edge cell: cb|abcd|cb
+    WRAP    //! Periodic grid: cd|abcd|ab
+};
+
+//! Separable kernels, odd sized and centred. The same 1D kernel is applied on rows and columns.
 namespace kernel
 {
-    const int smooth_size = 3;
-    const float ds = 1. / 16.;
-    const float smooth[9] = {
-        ds, 2. * ds, ds,
-        2. * ds, 4. * ds, 2. * ds,
-        ds, 2. * ds, ds};
-
-    const int blur_size = 3;
-    const float db = 1. / 9.;
-    const float blur[9] = {
-        db, db, db,
-        db, db, db,
-        db, db, db};
-
-    const int gauss_size = 3;
-    const float dg = 1. / 256.;
-    const float gauss[25] = {
-        dg * 1., dg * 4., dg * 6., dg * 4., dg * 1.,
-        dg * 4., dg * 16., dg * 24., dg * 16., dg * 4.,
-        dg * 6., dg * 24., dg * 36., dg * 24., dg * 6.,
-        dg * 4., dg * 16., dg * 24., dg * 16., dg * 4.,
-        dg * 1., dg * 4., dg * 6., dg * 4., dg * 1.};
+    const int smooth_radius = 1;
+    const float smooth[3] = {1.f / 4.f, 2.f / 4.f, 1.f / 4.f};
+
+    const int blur_radius = 1;
+    const float blur[3] = {1.f / 3.f, 1.f / 3.f, 1.f / 3.f};
+
+    const int gauss_radius = 2;
+    const float gauss[5] = {1.f / 16.f, 4.f / 16.f, 6.f / 16.f, 4.f / 16.f, 1.f / 16.f};
+
+    //! Normalized sampled gaussian of standard deviation sigma (in cells), truncated at 3 sigma. The identity for sigma <= 0.
+    std::vector<float> gaussian(float sigma);
+
+    //! Normalized box kernel of 2 * radius + 1 taps.
+    std::vector<float> box(int radius);
 } // namespace kernel
 
-void convolve(const std::vector<scalar_t> &input, std::vector<scalar_t> &output, const int nx, const int ny, const float *kernel, const int nk = 3);
+//! Map an index that may fall outside of [0, n) back into the grid.
+int border_index(int i, int n, BorderMode mode);
+
+//! Separable convolution: rows with kx (2 * rx + 1 taps), then columns with ky (2 * ry + 1 taps).
+//! Costs O(rx + ry) per cell. input and output must not overlap.
+void convolve(const scalar_t *input, scalar_t *output, int nx, int ny,
+              const float *kx, int rx, const float *ky, int ry, BorderMode mode = BorderMode::CLAMP);
+
+//! Single passes of the separable convolution, input and output must not overlap.
+void convolve_rows(const scalar_t *input, scalar_t *output, int nx, int ny, const float *k, int r, BorderMode mode = BorderMode::CLAMP);
+void convolve_columns(const scalar_t *input, scalar_t *output, int nx, int ny, const float *k, int r, BorderMode mode = BorderMode::CLAMP);
+
+//! Apply the same 1D kernel (2 * r + 1 taps) on both axes, iterations times, in place.
+//! The iterations are fused in a single sweep over the rows (temporal blocking), scratch is
+//! resized as needed and can be kept by the caller to avoid reallocating on the next call.
+void convolve_iterated(scalar_t *data, int nx, int ny, const float *k, int r, int iterations,
+                       BorderMode mode, std::vector<scalar_t> &scratch);
+
+//! Same 1D kernel (2 * r + 1 taps) on both axes.
+void convolve(const std::vector<scalar_t> &input, std::vector<scalar_t> &output, int nx, int ny,
+              const float *k, int r, BorderMode mode = BorderMode::CLAMP);
+
+//! Box filter of 2 * radius + 1 cells per axis using running (integral) sums, O(1) per cell whatever the radius.
+//! input and output may be the same buffer.
+void box_filter(const scalar_t *input, scalar_t *output, int nx, int ny, int radius, BorderMode mode = BorderMode::CLAMP);
+
+//! Recursive gaussian of Young & van Vliet (third order IIR, forward and backward), O(1) per cell whatever sigma.
+//! Within 2% of the true gaussian peak from sigma = 4 on, but only within about 5% for sigma <= 2: below
+//! sigma = 6, where the direct kernel::gaussian is exact and not slower, it is applied instead.
+//! input and output may be the same buffer.
+void recursive_gaussian(const scalar_t *input, scalar_t *output, int nx, int ny, float sigma, BorderMode mode = BorderMode::CLAMP);
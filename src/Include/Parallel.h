@@ -0,0 +1,44 @@
+#pragma once
+
+#include "pch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+//! Fixed set of worker threads shared by the whole application.
+//!
+//! parallel_for splits [begin, end) in contiguous chunks. The calling thread works on the
+//! chunks too, so a nested call from inside a task never waits on an idle queue.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    //! Pool used by default, sized on the hardware concurrency.
+    static ThreadPool &instance();
+
+    //! Number of threads working on a parallel_for, the calling thread included.
+    int size() const;
+
+    //! Call body(first, last) on disjoint chunks covering [begin, end), at most threads at a time
+    //! (0 uses the whole pool). Returns once every chunk is done.
+    void parallel_for(int begin, int end, const std::function<void(int, int)> &body, int threads = 0, int grain = 1);
+
+private:
+    void work();
+
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stop{false};
+};
+
+//! ThreadPool::instance().parallel_for(...)
+void parallel_for(int begin, int end, const std::function<void(int, int)> &body, int threads = 0, int grain = 1);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "pch.h"
+
+#include "Type.h"
+
+namespace mmv
+{
+    //! Right-triangulated irregular network of a row-major nx * ny grid (Evans et al. 2001, Martini).
+    //!
+    //! The grid is embedded in a (2^k + 1)^2 one, split by its diagonal into two right triangles,
+    //! themselves split recursively at the midpoint of their hypotenuse. The two triangles sharing a
+    //! hypotenuse split together, so every extracted mesh is conforming. Build stores, for every
+    //! midpoint, a bound on the vertical error of the triangles that would skip it; Extract walks the
+    //! hierarchy down to a given tolerance in time proportional to the output.
+    //!
+    //! Triangles crossing the last row or column of the grid are always split and the ones past it are
+    //! dropped, so the mesh covers exactly the grid. On other sizes than 2^k + 1, the mesh gets finer
+    //! towards these two borders.
+    class RTIN
+    {
+    public:
+        RTIN() = default;
+
+        //! Error hierarchy of the grid, to call again after every modification of the elevations.
+        void Build(const scalar_t *elevations, int nx, int ny);
+
+        //! Triangles whose vertical error is at most max_error. vertices receives the grid index
+        //! (j * nx + i) of every vertex used, indices three vertices per triangle.
+        void Extract(scalar_t max_error, std::vector<index_t> &vertices, std::vector<unsigned> &indices) const;
+
+        //! Error of the coarsest mesh: on 2^k + 1 grids, Extract at or above it returns two triangles.
+        scalar_t MaxError() const;
+
+        inline int Nx() const { return m_Nx; }
+        inline int Ny() const { return m_Ny; }
+
+    private:
+        //! Split the triangle (a, b, c), right angle in c, or keep it.
+        void Refine(int ax, int ay, int bx, int by, int cx, int cy, scalar_t max_error, std::vector<index_t> &vertices,
+                    std::vector<unsigned> &indices) const;
+
+    private:
+        int m_Nx{0}, m_Ny{0};
+        int m_Size{0}; //! Power of two, the grid is embedded in (m_Size + 1)^2 vertices
+
+        std::vector<scalar_t> m_Errors{}; //! Per cell of the grid, 0 on the corners of the leaves
+
+        //! Vertex of every grid cell in the mesh being extracted, ~0u when unused
+        mutable std::vector<unsigned> m_Remap{};
+    };
+} // namespace mmv
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "pch.h"
+
+#include <bit>
+
+//! Unsigned key with the same order as the float v (-0 sorts just before +0).
+inline std::uint32_t order_key(float v)
+{
+    const std::uint32_t bits = std::bit_cast<std::uint32_t>(v);
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+//! Inverse of order_key.
+inline float order_value(std::uint32_t key)
+{
+    return std::bit_cast<float>((key & 0x80000000u) ? key & 0x7fffffffu : ~key);
+}
+
+//! Monotone radix heap of 64-bit keys.
+//!
+//! Keys are bucketed by the highest byte where they differ from the last popped key, and by the
+//! value of that byte, so that the buckets are sorted: 1 + 8 * 256 buckets, bucket 0 holding the
+//! keys equal to the last one. Pushing is O(1) and a key moves to a lower bucket at most 8 times,
+//! instead of a log(n) sift with a comparison per level. The keys pushed must not be lower than
+//! the last popped one.
+class RadixHeap
+{
+public:
+    RadixHeap() = default;
+
+    inline bool empty() const { return m_size == 0; }
+    inline std::size_t size() const { return m_size; }
+
+    //! Last popped key, lower bound of every key in the heap.
+    inline std::uint64_t last() const { return m_last; }
+
+    inline void push(std::uint64_t key)
+    {
+        assert(key >= m_last);
+        insert(key);
+        ++m_size;
+    }
+
+    //! Smallest key.
+    inline std::uint64_t top()
+    {
+        refill();
+        return m_last;
+    }
+
+    inline void pop()
+    {
+        refill();
+        m_buckets[0].pop_back();
+        if (m_buckets[0].empty())
+            m_used[0] &= ~std::uint64_t(1);
+        --m_size;
+    }
+
+    inline void clear()
+    {
+        for (int word = 0; word < int(m_used.size()); ++word)
+        {
+            for (std::uint64_t used = m_used[word]; used != 0; used &= used - 1)
+                m_buckets[word * 64 + std::countr_zero(used)].clear();
+            m_used[word] = 0;
+        }
+        m_last = 0;
+        m_size = 0;
+    }
+
+private:
+    static constexpr int BUCKETS = 1 + 8 * 256;
+
+    inline void insert(std::uint64_t key)
+    {
+        const std::uint64_t diff = key ^ m_last;
+        int b = 0;
+        if (diff != 0)
+        {
+            const int byte = (63 - std::countl_zero(diff)) / 8;
+            b = 1 + byte * 256 + int((key >> (8 * byte)) & 0xff);
+        }
+
+        m_buckets[b].push_back(key);
+        m_used[b / 64] |= std::uint64_t(1) << (b % 64);
+    }
+
+    //! Make sure bucket 0 holds the smallest keys, redistributing the first non-empty bucket.
+    inline void refill()
+    {
+        assert(m_size > 0);
+        if (!m_buckets[0].empty())
+            return;
+
+        int word = 0;
+        while (m_used[word] == 0)
+            ++word;
+        const int b = word * 64 + std::countr_zero(m_used[word]);
+
+        std::vector<std::uint64_t> &bucket = m_buckets[b];
+        m_used[word] &= ~(std::uint64_t(1) << (b % 64));
+
+        m_last = *std::min_element(bucket.begin(), bucket.end());
+        for (const std::uint64_t key : bucket)
+            insert(key);
+        bucket.clear();
+    }
+
+    std::array<std::vector<std::uint64_t>, BUCKETS> m_buckets{};
+    std::array<std::uint64_t, (BUCKETS + 63) / 64> m_used{}; //! Bit b set when bucket b is not empty
+    std::uint64_t m_last{0};
+    std::size_t m_size{0};
+};
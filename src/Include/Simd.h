@@ -0,0 +1,46 @@
+#pragma once
+
+#include "pch.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//! Minimal SIMD wrapper so the grid kernels are written once for every target.
+namespace simd
+{
+#if defined(__AVX2__)
+    using vfloat = __m256;
+    constexpr int W = 8;
+    inline vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+    inline void store(float *p, vfloat v) { _mm256_storeu_ps(p, v); }
+    inline vfloat set1(float v) { return _mm256_set1_ps(v); }
+    inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+    inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+    inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+    inline vfloat div(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+    inline vfloat sqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+#elif defined(__SSE2__)
+    using vfloat = __m128;
+    constexpr int W = 4;
+    inline vfloat load(const float *p) { return _mm_loadu_ps(p); }
+    inline void store(float *p, vfloat v) { _mm_storeu_ps(p, v); }
+    inline vfloat set1(float v) { return _mm_set1_ps(v); }
+    inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+    inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+    inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+    inline vfloat div(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+    inline vfloat sqrt(vfloat a) { return _mm_sqrt_ps(a); }
+#else
+    using vfloat = float;
+    constexpr int W = 1;
+    inline vfloat load(const float *p) { return *p; }
+    inline void store(float *p, vfloat v) { *p = v; }
+    inline vfloat set1(float v) { return v; }
+    inline vfloat add(vfloat a, vfloat b) { return a + b; }
+    inline vfloat sub(vfloat a, vfloat b) { return a - b; }
+    inline vfloat mul(vfloat a, vfloat b) { return a * b; }
+    inline vfloat div(vfloat a, vfloat b) { return a / b; }
+    inline vfloat sqrt(vfloat a) { return std::sqrt(a); }
+#endif
+} // namespace simd
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "pch.h"
+
+#include "Type.h"
+
+//! Whole-grid finite difference kernels.
+//!
+//! Every kernel reads a row-major nx * ny grid and writes the whole output in one pass.
+//! Interior cells run branch-free on SIMD registers (AVX2, SSE2 or scalar depending on
+//! the target), the border rows and columns are handled in a separate peeled pass that
+//! reproduces the one-sided differences of the per-cell API.
+namespace stencil
+{
+    //! Number of floats processed per SIMD iteration (8 with AVX2, 4 with SSE2, 1 otherwise).
+    int simd_width();
+
+    //! Central differences (half step), one-sided on the borders.
+    void gradient(const scalar_t *h, int nx, int ny, scalar_t *gx, scalar_t *gy);
+
+    //! 5-point laplacian, shifted 3-point second derivatives on the borders.
+    void laplacian(const scalar_t *h, int nx, int ny, scalar_t *out);
+
+    //! Norm of the gradient, for n cells.
+    void slope(const scalar_t *gx, const scalar_t *gy, int n, scalar_t *out);
+
+    //! Unit normal normalize(-gx, 1, -gy), for n cells.
+    void normal(const scalar_t *gx, const scalar_t *gy, int n, scalar_t *nx, scalar_t *ny, scalar_t *nz);
+} // namespace stencil
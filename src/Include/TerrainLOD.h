@@ -0,0 +1,119 @@
+#pragma once
+
+#include "pch.h"
+
+#include "HeightField.h"
+
+namespace mmv
+{
+    //! Chunked quadtree level of detail of a height field (geomipmapping, CDLOD style selection).
+    //!
+    //! The field is covered by a quadtree of chunks of chunk_size^2 quads: a node of level l samples
+    //! the field every 2^l cells, the leaves at full resolution. Every chunk has the same vertex grid,
+    //! so a single index buffer is shared by all of them. Nodes are refined while their geometric
+    //! error projects to more than a given number of pixels, and only the nodes in the view frustum
+    //! are kept. Skirts hanging under the border of every chunk hide the cracks between chunks of
+    //! different levels.
+    //!
+    //! Build and Select only work on the CPU. Draw keeps the vertex buffers of the chunks it draws,
+    //! and rewrites them in place after an edit of the height field.
+    class TerrainLOD
+    {
+    public:
+        struct Node
+        {
+            int level, x, y;
+        };
+
+        explicit TerrainLOD(int chunk_size = 64);
+        ~TerrainLOD() = default;
+
+        TerrainLOD(const TerrainLOD &) = delete;
+        TerrainLOD &operator=(const TerrainLOD &) = delete;
+
+        //! Bounds and geometric errors of the quadtree, to call again after every edit of the height field.
+        void Build(const HeightField &hf);
+
+        //! Select the visible nodes, refined until their error is below max_pixel_error pixels on a
+        //! viewport of the given height, fov being the vertical field of view in degrees. Called once
+        //! per frame: it advances the frame count and deletes the chunks not drawn for a while.
+        const std::vector<Node> &Select(const Transform &model, const Transform &view, const Transform &projection,
+                                        float viewport_height, float fov, float max_pixel_error);
+
+        //! Draw the selected nodes with the current program, uploading the missing chunks first. Can be
+        //! called several times per frame, e.g. once per primitive type.
+        void Draw(const HeightField &hf, GLenum primitives);
+
+        //! Delete every GL object.
+        void Release();
+
+        //! Vertices of a node, packed as floats (xyz, xyz, uv): the (chunk_size + 1)^2 grid, then its skirt.
+        void ChunkVertices(const HeightField &hf, const Node &node, std::vector<float> &positions, std::vector<float> &normals,
+                           std::vector<float> &texcoords) const;
+
+        //! Triangles of a chunk and of its skirt, shared by every node.
+        void ChunkIndices(std::vector<unsigned> &indices) const;
+
+        inline int Levels() const { return int(m_Levels.size()); }
+        inline int ChunkSize() const { return m_ChunkSize; }
+        inline const std::vector<Node> &Selection() const { return m_Selection; }
+
+        //! Geometric error of a node, the largest vertical distance between its surface and the full resolution one.
+        scalar_t Error(const Node &node) const;
+
+        //! Triangles drawn for the current selection, skirts excluded.
+        inline int TriangleCount() const { return int(m_Selection.size()) * m_ChunkSize * m_ChunkSize * 2; }
+
+        //! Number of chunks with vertex buffers on the GPU.
+        inline int CachedCount() const { return int(m_Chunks.size()); }
+
+    private:
+        struct Level
+        {
+            int nx, ny;
+            std::vector<scalar_t> error, zmin, zmax;
+        };
+
+        struct Chunk
+        {
+            GLuint vao{0};
+            GLuint buffers[3]{0, 0, 0};
+            std::uint64_t version{0};
+            int frame{0};
+        };
+
+        inline int Stride(int level) const { return 1 << level; }
+        inline int Extent(int level) const { return m_ChunkSize << level; }
+        inline std::uint64_t Key(const Node &node) const
+        {
+            return std::uint64_t(node.level) << 56 | std::uint64_t(node.y) << 28 | std::uint64_t(node.x);
+        }
+
+        void Refine(const Node &node);
+
+    private:
+        int m_ChunkSize;
+        int m_Nx{0}, m_Ny{0};
+        std::vector<Level> m_Levels{};
+
+        //! Depth of the skirts, twice the largest error: deeper than any crack
+        scalar_t m_SkirtDepth{0};
+
+        //! Selection state
+        std::vector<Node> m_Selection{};
+        float m_Planes[6][4]{};
+        Point m_Eye{};
+        vec3 m_Scale{1.f, 1.f, 1.f};
+        float m_PixelsPerError{0};
+        float m_MaxPixelError{1};
+
+        //! GL objects, the chunks not drawn for a while are deleted
+        std::unordered_map<std::uint64_t, Chunk> m_Chunks{};
+        GLuint m_IndexBuffer{0};
+        int m_IndexCount{0};
+        std::uint64_t m_Version{1};
+        int m_Frame{0};
+
+        std::vector<float> m_Positions{}, m_Normals{}, m_Texcoords{};
+    };
+} // namespace mmv
@@ -6,6 +6,7 @@
 #include "Framebuffer.h"
 #include "Timer.h"
 #include "HeightField.h"
+#include "TerrainLOD.h"
 
 class Viewer : public App
 {
@@ -27,7 +28,14 @@ private:
     int render_ui();
     int render_any();
 
-    int update_height_field(bool export_elevation=true);
+    int update_height_field();
+    int update_bounds();
+    int draw_height_map(GLenum primitives);
+    int update_overlays();
+    int update_shading();
+    int update_stream_area();
+    int generate_elevations();
+    int export_maps();
     int erode();
     int smooth();
 
@@ -45,8 +53,6 @@ private:
     int screenshot();
 
 private:
-    Mesh m_height_map;
-
     //! Application params
     Framebuffer m_ImGUIFramebuffer;
     
@@ -62,6 +68,16 @@ private:
     int m_breaching_us{0};
     int m_smooth_us{0};
 
+    int m_smooth_iterations{1};
+    int m_flow_mode{0}; //! flow::Mode of the stream area overlay and export
+
+    //! Stream power law
+    float m_uplift{0.f};
+    float m_erodibility{0.1f};
+    float m_area_exponent{0.5f};
+    float m_slope_exponent{1.f};
+    float m_dt{1.f};
+
 
     bool m_show_faces{true};
     bool m_show_edges{false};
@@ -101,11 +117,20 @@ private:
 
     int m_resolution{128};
 
+    //! Adaptive mesh of the full resolution HF instead of the resolution^2 grid, within m_adaptive_error
+    bool m_adaptive{false};
+    float m_adaptive_error{0.5f};
+
+    //! Export the resolution^2 grid simplified down to m_export_triangles (QEM)
+    bool m_decimate_export{false};
+    int m_export_triangles{100000};
+
     int m_map_dim{128};
 
     //! Noise
     float m_hurst{0.2f};
     float m_lacunarity{2.5f};
+    float m_octaves{5.f};
     float m_base_scale{0.005f};
     int m_offset[2]{0, 0};
     int m_seed{0};
@@ -133,10 +158,21 @@ private:
 
     GLuint m_buffers[VBO_TYPE::NB_VBO];
 
+    //! Height map geometry: positions and normals are rewritten after every edit, the texcoords and
+    //! the index buffer only when the resolution changes
     std::vector<float> m_positions;
     std::vector<float> m_texcoords;
     std::vector<float> m_normals;
 
+    GLuint m_index_buffer{0};
+    int m_index_count{0};
+    int m_index_resolution{0}; //! Resolution of the uploaded index buffer, 0 before the first upload
+
+    //! Chunked level of detail, drawn instead of the uniform mesh when enabled
+    mmv::TerrainLOD m_terrain;
+    bool m_lod{false};
+    float m_lod_pixel_error{2.f};
+
     Vector m_object_scale{1.f, 1.f, 1.f};
 
     //! Shaders
@@ -157,6 +193,9 @@ private:
     GLuint m_tex_shading{0};
     GLuint m_tex_stream_area{0};
 
+    //! Scratch buffer reused to upload the overlay maps
+    ImageData m_overlay_image;
+
     Vector m_shading_dir{-1.f, -1.f, -1.f};
 
     std::string m_filename{""};
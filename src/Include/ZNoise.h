@@ -56,6 +56,25 @@ namespace mmv
 //! Znoise interface
 namespace znoise
 {
+    //! Pure generators: fill a caller supplied width * height buffer with elevations in [0, scale],
+    //! no file is written. Any contiguous storage works, e.g. std::span<float>(hf.Data(), n).
+    void fill_perlin(std::span<float> elevations, float scale, int width, int height);
+    void fill_perlin_3dslice(std::span<float> elevations, float scale, int width, int height);
+    void fill_perlin_4dslice(std::span<float> elevations, float scale, int width, int height);
+    void fill_simplex(std::span<float> elevations, float scale, int width, int height);
+    void fill_simplex_3dslice(std::span<float> elevations, float scale, int width, int height);
+    void fill_simplex_4dslice(std::span<float> elevations, float scale, int width, int height);
+    void fill_worley(std::span<float> elevations, float scale, int width, int height, WorleyFunction worleyFunc);
+
+    //! hmf and fbm rows are generated on the thread pool (threads = 0 uses the whole pool), the result only depends on the seed.
+    //! octaves comes last and defaults to the former fixed 5: integer counts from 1 to 12 run the specialised FBMT/HybridMultiFractalT, the others the runtime mixers.
+    void fill_hmf(std::span<float> elevations, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0, int threads = 0, float octaves = 5.f);
+    void fill_fbm(std::span<float> elevations, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0, int threads = 0, float octaves = 5.f);
+
+    //! Optional image sink: write elevations in [0, scale] as a grayscale PNG in DATA_DIR/output.
+    int write_elevation_image(const std::string &filename, std::span<const float> elevations, int width, int height, float scale);
+
+    //! fill_* into a new buffer, then write_elevation_image(filename).
     std::vector<float> generate_perlin(const std::string &filename, float scale, int width, int height);
 
     std::vector<float> generate_perlin_3dslice(const std::string &filename, float scale, int width, int height);
@@ -70,7 +89,7 @@ namespace znoise
     
     std::vector<float> generate_worley(const std::string &filename, float scale, int width, int height, WorleyFunction worleyFunc);
     
-    std::vector<float> generate_hmf(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0);
+    std::vector<float> generate_hmf(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0, int threads = 0, float octaves = 5.f);
     
-    std::vector<float> generate_fbm(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0);
+    std::vector<float> generate_fbm(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset = 0, int y_offset = 0, unsigned int seed = 0, int threads = 0, float octaves = 5.f);
 } // namespace znoise
@@ -20,6 +20,9 @@ GLuint read_program(const std::string &shader);
 
 GLuint read_texture(const int unit, const std::string &texture);
 
+//! Upload an image into an existing texture, (re)creating it when needed. Return the texture id.
+GLuint update_texture(GLuint texture, const int unit, const ImageData &image);
+
 Image read_image(const std::string &image);
 
 GLuint read_cubemap(const int unit, const std::string &filename, const GLenum texel_type = GL_RGBA);
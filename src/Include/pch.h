@@ -10,6 +10,7 @@
 #include <cassert>
 #include <chrono>
 #include <cstdio>
+#include <cstdint>
 #include <fstream>
 
 //! Data structures 
@@ -45,6 +46,7 @@
 //! ZNoise
 #include "Enums.hpp"
 #include "FBM.hpp"
+#include "FractalT.hpp"
 #include "HybridMultiFractal.hpp"
 #include "Perlin.hpp"
 #include "Simplex.hpp"
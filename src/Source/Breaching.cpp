@@ -1,11 +1,161 @@
 #include "Breaching.h"
 #include "HeightField.h"
+#include "Parallel.h"
+#include "Utils.h"
+
+#include <unordered_map>
 
 // Neighbour Directions
 const int DIRECTIONS = 8;
 const int dx[DIRECTIONS] = {-1, -1, 0, 1, 1, 1, 0, -1};
 const int dy[DIRECTIONS] = {0, -1, -1, -1, 0, 1, 1, 1};
 
+namespace
+{
+    //! Packed state of a cell while breaching, one byte per cell: the LindsayCellType in bits 0-1, the
+    //! pit flag in bit 2 and the direction it was reached from in bits 3-5, in place of a parent index.
+    const std::uint8_t CELL_TYPE = 0x3;
+    const std::uint8_t CELL_PIT = 0x4;
+    const int CELL_LINK_SHIFT = 3;
+
+    //! Visited state of a cell reached from its neighbour -(dx[n], dy[n]), keeping the pit flag.
+    inline std::uint8_t visited_from(std::uint8_t state, int n)
+    {
+        return std::uint8_t((state & CELL_PIT) | mmv::LindsayCellType::VISITED | (n << CELL_LINK_SHIFT));
+    }
+
+    //! Label of the cells draining to the edge of the grid in the tiled Priority-Flood.
+    const int OCEAN = 1;
+
+    //! Priority-Flood of a single tile, seeded from its perimeter. Each perimeter cell not reached
+    //! from another one starts a new watershed label, the cells of a tile only see the tile.
+    //! The buffers are reused from one tile to the next, a worker only holds one tile at a time.
+    struct TileFlood
+    {
+        int w = 0, h = 0;
+        std::vector<float> z;
+        std::vector<int> labels;
+        int label_count = 0;
+
+        //! Lowest spill elevation between two labels of the tile, keyed by (lower label, upper label).
+        std::unordered_map<std::uint64_t, float> spills;
+
+        inline bool OnPerimeter(int i, int j) const { return i == 0 || i == w - 1 || j == 0 || j == h - 1; }
+
+        void Flood(const float *elements, int nx, int ny, int x0, int y0, int tw, int th, bool record_spills)
+        {
+            w = tw;
+            h = th;
+            z.resize(std::size_t(w) * h);
+            labels.assign(std::size_t(w) * h, 0);
+            spills.clear();
+            m_Open.clear();
+
+            for (int j = 0; j < h; j++)
+                for (int i = 0; i < w; i++)
+                    z[j * w + i] = elements[std::size_t(y0 + j) * nx + x0 + i];
+
+            for (int j = 0; j < h; j++)
+            {
+                for (int i = 0; i < w; i++)
+                {
+                    if (!OnPerimeter(i, j))
+                        continue;
+
+                    const int x = x0 + i, y = y0 + j;
+                    if (x == 0 || x == nx - 1 || y == 0 || y == ny - 1)
+                        labels[j * w + i] = OCEAN;
+                    m_Open.push(std::uint64_t(order_key(z[j * w + i])) << 32 | std::uint32_t(j * w + i));
+                }
+            }
+
+            int next_label = OCEAN + 1;
+            while (!m_Open.empty() || !m_Pit.empty())
+            {
+                int c;
+                if (!m_Pit.empty())
+                {
+                    c = m_Pit.front();
+                    m_Pit.pop();
+                }
+                else
+                {
+                    c = int(m_Open.top() & 0xffffffffu);
+                    m_Open.pop();
+                }
+
+                if (labels[c] == 0)
+                    labels[c] = next_label++;
+
+                const int ci = c % w, cj = c / w;
+                for (int n = 0; n < DIRECTIONS; n++)
+                {
+                    const int i = ci + dx[n], j = cj + dy[n];
+                    if (i < 0 || i >= w || j < 0 || j >= h)
+                        continue;
+
+                    const int k = j * w + i;
+                    if (labels[k] != 0)
+                    {
+                        if (record_spills && labels[k] != labels[c])
+                        {
+                            const int a = std::min(labels[k], labels[c]), b = std::max(labels[k], labels[c]);
+                            const float spill = std::max(z[k], z[c]);
+                            auto it = spills.try_emplace(std::uint64_t(a) << 32 | std::uint32_t(b), spill).first;
+                            it->second = std::min(it->second, spill);
+                        }
+                        continue;
+                    }
+
+                    labels[k] = labels[c];
+
+                    // Perimeter cells are already queued, and not lower than the current level
+                    if (OnPerimeter(i, j))
+                        continue;
+
+                    if (z[k] <= z[c])
+                    {
+                        z[k] = z[c];
+                        m_Pit.push(k);
+                    }
+                    else
+                    {
+                        m_Open.push(std::uint64_t(order_key(z[k])) << 32 | std::uint32_t(k));
+                    }
+                }
+            }
+
+            label_count = next_label - (OCEAN + 1);
+        }
+
+    private:
+        RadixHeap m_Open;
+        std::queue<int> m_Pit;
+    };
+
+    //! Labels of the perimeter of a tile, kept between the two passes of the tiled Priority-Flood.
+    struct TilePerimeter
+    {
+        std::vector<int> top, bottom, left, right;
+
+        //! Label of the perimeter cell (i, j) of a tile of height h, i = 0 being the left column.
+        inline int At(int i, int j, int h) const
+        {
+            if (j == 0)
+                return top[i];
+            if (j == h - 1)
+                return bottom[i];
+            return i == 0 ? left[j] : right[j];
+        }
+    };
+
+    struct SpillEdge
+    {
+        int a, b;
+        float z;
+    };
+} // namespace
+
 namespace mmv
 {
     /*!
@@ -23,18 +173,23 @@ namespace mmv
 
     \author John Lindsay, implementation by Richard Barnes (rbarnes@umn.edu).
     */
-    void HeightField::CompleteBreach()
+    void HeightField::CompleteBreach(LindsayMode mode, scalar_t max_depth, int max_length, bool fill_depressions)
     {
-        int mode = COMPLETE_BREACHING;
-        bool fill_depressions = true;
-
         const int NO_BACK_LINK = -1;
 
-        Array2<int> backlinks(m_Nx, m_Ny, NO_BACK_LINK);
-        Array2<int> visited(m_Nx, m_Ny, LindsayCellType::UNVISITED);
-        Array2<int> pits(m_Nx, m_Ny, false);
-        std::vector<index_t> flood_array;
-        ZPriorityQueue pq;
+        std::vector<std::uint8_t> &cells = m_BreachingCells;
+        cells.assign(m_Elements.size(), LindsayCellType::UNVISITED);
+        std::vector<index_t> &flood_array = m_FloodOrder;
+        flood_array.clear();
+        ZRadixQueue pq(m_Ny);
+
+        // Cell a path goes back to, NO_BACK_LINK past an edge cell
+        int link_offsets[DIRECTIONS];
+        for (int n = 0; n < DIRECTIONS; n++)
+            link_offsets[n] = dy[n] * m_Nx + dx[n];
+        auto backlink = [&](index_t c) {
+            return (cells[c] & CELL_TYPE) == LindsayCellType::EDGE ? NO_BACK_LINK : c - link_offsets[cells[c] >> CELL_LINK_SHIFT];
+        };
 
         int total_pits = 0;
 
@@ -47,7 +202,7 @@ namespace mmv
                 if (i == 0 || i == (m_Nx - 1) || j == 0 || j == (m_Ny - 1))
                 {
                     pq.emplace(At(i, j), IPoint2(i, j));
-                    visited(i, j) = LindsayCellType::EDGE;
+                    cells[OneDIndex(i, j)] = LindsayCellType::EDGE;
                     continue;
                 }
 
@@ -74,7 +229,7 @@ namespace mmv
                 // flat/pits as such now.
                 if (At(i, j) <= lowest_neighbour)
                 {
-                    pits(i, j) = true;
+                    cells[OneDIndex(i, j)] |= CELL_PIT;
                     total_pits++; // May not need this
                 }
             }
@@ -90,7 +245,7 @@ namespace mmv
             const IPoint2 p = c.second;
 
             // T Cell is a pit, consider doing some breaching: locate a cell that is lower than the pit cell, or an edge cell
-            if (pits(p.x(), p.y()))
+            if (cells[OneDIndex(p.x(), p.y())] & CELL_PIT)
             {
                 index_t cc = OneDIndex(p.x(), p.y());      // Current cell on the path
                 scalar_t target_height = At(p.x(), p.y()); // Depth to which the cell currently being considered should be carved
@@ -101,16 +256,45 @@ namespace mmv
                     while (cc != NO_BACK_LINK && At(cc) >= target_height)
                     {
                         m_Elements[cc] = target_height;
-                        cc = backlinks.At(cc);                      // Follow path back
+                        cc = backlink(cc);                      // Follow path back
                         target_height = target_height - 2.0 * 1e-5; // Decrease target depth slightly for each cell on path to ensure drainage
                     }
                 }
                 else
                 {
+                    // Trace the path back as in complete breaching, giving up as soon as it is too long or,
+                    // in selective breaching, too deep: the search never goes beyond max_length cells
+                    int path_length = 0;
+                    scalar_t path_depth = 0;
+                    while (cc != NO_BACK_LINK && At(cc) >= target_height && path_length <= max_length)
+                    {
+                        path_depth = std::max(path_depth, At(cc) - target_height);
+                        if (mode == SELECTIVE_BREACHING && path_depth > max_depth)
+                            break;
+
+                        cc = backlink(cc);
+                        target_height = target_height - 2.0 * 1e-5;
+                        path_length++;
+                    }
+
+                    const bool found = (cc == NO_BACK_LINK || At(cc) < target_height) && path_length <= max_length;
+                    if (found && (mode == CONSTRAINED_BREACHING || path_depth <= max_depth))
+                    {
+                        // Carve the path, at most max_depth deep. A constrained path may not drain the
+                        // pit entirely, the filling below takes care of the rest.
+                        cc = OneDIndex(p.x(), p.y());
+                        target_height = At(cc);
+                        for (int k = 0; k < path_length; k++)
+                        {
+                            m_Elements[cc] = std::max(target_height, At(cc) - max_depth);
+                            cc = backlink(cc);
+                            target_height = target_height - 2.0 * 1e-5;
+                        }
+                    }
                 }
 
                 --total_pits;
-                if (total_pits == 0)
+                if (total_pits == 0 && !(mode != COMPLETE_BREACHING && fill_depressions))
                     break;
             }
 
@@ -122,30 +306,277 @@ namespace mmv
 
                 if (!InBounds(pi, pj))
                     continue;
-                if (visited(pi, pj) != LindsayCellType::UNVISITED)
+                const index_t k = OneDIndex(pi, pj);
+                if ((cells[k] & CELL_TYPE) != LindsayCellType::UNVISITED)
                     continue;
 
                 const scalar_t my_e = At(pi, pj);
 
                 // The neighbour is unvisited. Add it to the queue
                 pq.emplace(my_e, IPoint2(pi, pj));
-                if (fill_depressions)
-                    flood_array.emplace_back(OneDIndex(pi, pj));
-                visited(pi, pj) = LindsayCellType::VISITED;
-                backlinks(pi, pj) = OneDIndex(p.x(), p.y());
+                if (mode != COMPLETE_BREACHING && fill_depressions)
+                    flood_array.emplace_back(k);
+                cells[k] = visited_from(cells[k], n);
+            }
+        }
+
+        // Fill what was not breached: the flood order visits the parent of a cell before the cell
+        if (mode != COMPLETE_BREACHING && fill_depressions)
+        {
+            for (const auto f : flood_array)
+            {
+                const index_t parent = backlink(f);
+                if (At(f) <= At(parent))
+                    m_Elements[f] = std::nextafter(At(parent), std::numeric_limits<scalar_t>::max());
+            }
+        }
+
+        Touch();
+    }
+
+    /*!
+    \brief Fill depressions, leaving an epsilon gradient towards their outlet (Priority-Flood+epsilon).
+
+    Cells which are not higher than the cell they are reached from are inside a depression or a
+    flat: they are raised just above it and go to a plain FIFO queue. Only the cells above go
+    through the priority queue, which removes most of the heap traffic on real terrains.
+
+    See Barnes, Lehman, Mulla 2014, Priority-Flood: An optimal depression-filling and
+    watershed-labeling algorithm for digital elevation models.
+
+    See https://github.com/r-barnes/richdem/blob/master/include/richdem/depressions/Barnes2014.hpp
+    */
+    void HeightField::FillDepressions()
+    {
+        std::vector<std::uint8_t> &cells = m_BreachingCells;
+        cells.assign(m_Elements.size(), LindsayCellType::UNVISITED);
+        ZRadixQueue open(m_Ny);
+        std::queue<index_t> pit;
+
+        // Seed the priority queue with the edge cells
+        for (int j = 0; j < m_Ny; j++)
+        {
+            for (int i = 0; i < m_Nx; i++)
+            {
+                if (i == 0 || i == (m_Nx - 1) || j == 0 || j == (m_Ny - 1))
+                {
+                    open.emplace(At(i, j), IPoint2(i, j));
+                    cells[OneDIndex(i, j)] = LindsayCellType::EDGE;
+                }
+            }
+        }
+
+        while (!open.empty() || !pit.empty())
+        {
+            index_t c;
+            if (!pit.empty() && !open.empty() && open.top().first == At(pit.front()))
+            {
+                // Same elevation as the depression being filled: the heap goes first, as in the plain Priority-Flood
+                const IPoint2 p = open.top().second;
+                open.pop();
+                c = OneDIndex(p.x(), p.y());
+            }
+            else if (!pit.empty())
+            {
+                c = pit.front();
+                pit.pop();
+            }
+            else
+            {
+                const IPoint2 p = open.top().second;
+                open.pop();
+                c = OneDIndex(p.x(), p.y());
             }
 
-            if (mode != COMPLETE_BREACHING && fill_depressions)
+            const int ci = c % m_Nx, cj = c / m_Nx;
+            const scalar_t raised = std::nextafter(At(c), std::numeric_limits<scalar_t>::max());
+
+            for (int n = 0; n < DIRECTIONS; n++)
             {
-                for (const auto f : flood_array)
+                const index_t pi = ci + dx[n];
+                const index_t pj = cj + dy[n];
+
+                if (!InBounds(pi, pj) || cells[OneDIndex(pi, pj)] != LindsayCellType::UNVISITED)
+                    continue;
+                cells[OneDIndex(pi, pj)] = LindsayCellType::VISITED;
+
+                if (At(pi, pj) <= raised)
                 {
-                    int parent = backlinks.At(f);
-                    if (At(f) <= At(parent))
+                    m_Elements[OneDIndex(pi, pj)] = raised;
+                    pit.push(OneDIndex(pi, pj));
+                }
+                else
+                {
+                    open.emplace(At(pi, pj), IPoint2(pi, pj));
+                }
+            }
+        }
+
+        Touch();
+    }
+
+    /*!
+    \brief Fill depressions with the tiled Priority-Flood, one tile per task.
+
+    Every tile is flooded on its own from its perimeter, labelling the watershed of each perimeter
+    cell and the lowest spill elevation between neighbouring watersheds. The spill elevations within
+    and across tiles form a small graph, flooded from the edge of the grid to get the level of every
+    watershed. A second pass floods the tiles again and raises every cell to the level of its
+    watershed. The tile labels are recomputed rather than kept, so a worker only holds one tile.
+
+    Same result as a Priority-Flood without epsilon: depressions become flat.
+
+    See Barnes 2016, Parallel Priority-Flood depression filling for trillion cell digital elevation models on desktops or clusters.
+    */
+    void HeightField::FillDepressionsTiled(int tile_size, int threads)
+    {
+        tile_size = std::max(tile_size, 2);
+        const int tx = (m_Nx + tile_size - 1) / tile_size;
+        const int ty = (m_Ny + tile_size - 1) / tile_size;
+        const int tiles = tx * ty;
+
+        auto tile_width = [&](int t) { return std::min(tile_size, m_Nx - (t % tx) * tile_size); };
+        auto tile_height = [&](int t) { return std::min(tile_size, m_Ny - (t / tx) * tile_size); };
+
+        std::vector<TilePerimeter> perimeters(tiles);
+        std::vector<std::vector<SpillEdge>> tile_edges(tiles);
+        std::vector<int> label_counts(tiles);
+
+        // Flood every tile, keep the perimeter labels and the spill elevations between local labels
+        parallel_for(0, tiles, [&](int first, int last) {
+            TileFlood flood;
+            for (int t = first; t < last; t++)
+            {
+                const int w = tile_width(t), h = tile_height(t);
+                flood.Flood(m_Elements.data(), m_Nx, m_Ny, (t % tx) * tile_size, (t / tx) * tile_size, w, h, true);
+
+                TilePerimeter &perimeter = perimeters[t];
+                perimeter.top.assign(flood.labels.begin(), flood.labels.begin() + w);
+                perimeter.bottom.assign(flood.labels.end() - w, flood.labels.end());
+                perimeter.left.resize(h);
+                perimeter.right.resize(h);
+                for (int j = 0; j < h; j++)
+                {
+                    perimeter.left[j] = flood.labels[j * w];
+                    perimeter.right[j] = flood.labels[j * w + w - 1];
+                }
+
+                for (const auto &[key, z] : flood.spills)
+                    tile_edges[t].push_back({int(key >> 32), int(key & 0xffffffffu), z});
+                label_counts[t] = flood.label_count;
+            }
+        }, threads);
+
+        // Global labels: the local labels of tile t start at base[t]
+        std::vector<int> base(tiles);
+        int label_count = OCEAN + 1;
+        for (int t = 0; t < tiles; t++)
+        {
+            base[t] = label_count;
+            label_count += label_counts[t];
+        }
+
+        auto global_label = [&](int t, int label) { return label == OCEAN ? OCEAN : base[t] + label - (OCEAN + 1); };
+
+        auto perimeter_label = [&](int x, int y) {
+            const int t = (y / tile_size) * tx + x / tile_size;
+            return global_label(t, perimeters[t].At(x % tile_size, y % tile_size, tile_height(t)));
+        };
+
+        // Spill graph: edges within tiles, then between neighbouring perimeter cells of different tiles
+        std::vector<SpillEdge> edges;
+        for (int t = 0; t < tiles; t++)
+        {
+            for (const SpillEdge &e : tile_edges[t])
+                edges.push_back({global_label(t, e.a), global_label(t, e.b), e.z});
+            tile_edges[t] = {};
+
+            const int x0 = (t % tx) * tile_size, y0 = (t / tx) * tile_size;
+            const int w = tile_width(t), h = tile_height(t);
+            for (int j = 0; j < h; j++)
+            {
+                for (int i = 0; i < w; i += (j == 0 || j == h - 1) ? 1 : std::max(w - 1, 1))
+                {
+                    const int x = x0 + i, y = y0 + j;
+                    for (int n = 0; n < DIRECTIONS; n++)
                     {
-                        m_Elements[f] = std::nextafter(At(parent), std::numeric_limits<scalar_t>::max());
+                        const int px = x + dx[n], py = y + dy[n];
+                        if (!InBounds(px, py) || OneDIndex(px, py) < OneDIndex(x, y))
+                            continue;
+                        if (px / tile_size == x / tile_size && py / tile_size == y / tile_size)
+                            continue;
+
+                        const int a = perimeter_label(x, y), b = perimeter_label(px, py);
+                        if (a != b)
+                            edges.push_back({a, b, std::max(At(x, y), At(px, py))});
                     }
                 }
             }
         }
+
+        std::vector<int> offsets(label_count + 1, 0);
+        for (const SpillEdge &e : edges)
+        {
+            offsets[e.a + 1]++;
+            offsets[e.b + 1]++;
+        }
+        for (int l = 0; l < label_count; l++)
+            offsets[l + 1] += offsets[l];
+
+        std::vector<std::pair<int, float>> adjacency(offsets[label_count]);
+        {
+            std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+            for (const SpillEdge &e : edges)
+            {
+                adjacency[fill[e.a]++] = {e.b, e.z};
+                adjacency[fill[e.b]++] = {e.a, e.z};
+            }
+        }
+        edges = {};
+
+        // Flood the graph from the edge of the grid: the level of a watershed is its lowest path to the edge
+        std::vector<float> levels(label_count, std::numeric_limits<float>::max());
+        levels[OCEAN] = std::numeric_limits<float>::lowest();
+        {
+            using Level = std::pair<float, int>;
+            std::priority_queue<Level, std::vector<Level>, std::greater<Level>> open;
+            open.emplace(levels[OCEAN], OCEAN);
+            while (!open.empty())
+            {
+                const auto [level, label] = open.top();
+                open.pop();
+                if (level > levels[label])
+                    continue;
+
+                for (int k = offsets[label]; k < offsets[label + 1]; k++)
+                {
+                    const auto [next, spill] = adjacency[k];
+                    const float z = std::max(level, spill);
+                    if (z < levels[next])
+                    {
+                        levels[next] = z;
+                        open.emplace(z, next);
+                    }
+                }
+            }
+        }
+
+        // Flood the tiles again and raise every cell to the level of its watershed. A tile only reads
+        // and writes its own cells, so the tiles can be updated in place.
+        parallel_for(0, tiles, [&](int first, int last) {
+            TileFlood flood;
+            for (int t = first; t < last; t++)
+            {
+                const int x0 = (t % tx) * tile_size, y0 = (t / tx) * tile_size;
+                const int w = tile_width(t), h = tile_height(t);
+                flood.Flood(m_Elements.data(), m_Nx, m_Ny, x0, y0, w, h, false);
+
+                for (int j = 0; j < h; j++)
+                    for (int i = 0; i < w; i++)
+                        m_Elements[OneDIndex(x0 + i, y0 + j)] = std::max(flood.z[j * w + i], levels[global_label(t, flood.labels[j * w + i])]);
+            }
+        }, threads);
+
+        Touch();
     }
 } // namespace mmv
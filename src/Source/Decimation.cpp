@@ -0,0 +1,460 @@
+#include "Decimation.h"
+
+#include "Parallel.h"
+
+namespace
+{
+    //! Sum of the squared distances to a set of planes, weighted by their area.
+    struct Quadric
+    {
+        double a2{0}, ab{0}, ac{0}, ad{0}, b2{0}, bc{0}, bd{0}, c2{0}, cd{0}, d2{0};
+        double weight{0};
+
+        void AddPlane(double a, double b, double c, double d, double w)
+        {
+            a2 += w * a * a, ab += w * a * b, ac += w * a * c, ad += w * a * d;
+            b2 += w * b * b, bc += w * b * c, bd += w * b * d;
+            c2 += w * c * c, cd += w * c * d;
+            d2 += w * d * d;
+            weight += w;
+        }
+
+        Quadric &operator+=(const Quadric &q)
+        {
+            a2 += q.a2, ab += q.ab, ac += q.ac, ad += q.ad, b2 += q.b2, bc += q.bc, bd += q.bd, c2 += q.c2, cd += q.cd, d2 += q.d2;
+            weight += q.weight;
+            return *this;
+        }
+
+        //! Mean squared distance of p to the planes.
+        double Error(const vec3 &p) const
+        {
+            const double x = p.x, y = p.y, z = p.z;
+            const double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x + b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+                             c2 * z * z + 2 * cd * z + d2;
+            return std::max(e, 0.0) / std::max(weight, 1e-30);
+        }
+
+        //! Point of least error, false when the planes do not define one (flat or cylindrical areas).
+        bool Minimum(vec3 &p) const
+        {
+            const double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+            const double scale = a2 + b2 + c2;
+            if (std::abs(det) <= 1e-6 * scale * scale * scale)
+                return false;
+
+            //! Cramer's rule on the symmetric system A p = -(ad, bd, cd)
+            const double x = -(ad * (b2 * c2 - bc * bc) - ab * (bd * c2 - bc * cd) + ac * (bd * bc - b2 * cd)) / det;
+            const double y = -(a2 * (bd * c2 - cd * bc) - ad * (ab * c2 - bc * ac) + ac * (ab * cd - bd * ac)) / det;
+            const double z = -(a2 * (b2 * cd - bc * bd) - ab * (ab * cd - bd * ac) + ad * (ab * bc - b2 * ac)) / det;
+            p = vec3(float(x), float(y), float(z));
+            return true;
+        }
+    };
+
+    Quadric operator+(Quadric a, const Quadric &b) { return a += b; }
+
+    //! Unnormalized normal of the triangle (a, b, c).
+    inline vec3 normal(const vec3 &a, const vec3 &b, const vec3 &c)
+    {
+        const float ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+        const float vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+        return vec3(uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx);
+    }
+
+    //! Collapse of u into v, v moving to p.
+    struct Collapse
+    {
+        double error;
+        int u, v;
+        unsigned stamp;
+        vec3 p;
+
+        bool operator>(const Collapse &c) const { return error > c.error; }
+    };
+
+    //! Simplification of the triangles of one tile. Vertices are numbered locally, every structure is
+    //! private to the tile but the positions of its unlocked vertices, only used by its own triangles.
+    class TileDecimation
+    {
+    public:
+        TileDecimation(const std::vector<vec3> &positions, const unsigned *triangles, int count) : m_Count(count), m_Left(count)
+        {
+            m_Global.assign(triangles, triangles + 3 * std::size_t(count));
+            std::sort(m_Global.begin(), m_Global.end());
+            m_Global.erase(std::unique(m_Global.begin(), m_Global.end()), m_Global.end());
+            const int n = int(m_Global.size());
+
+            m_Triangles.resize(3 * std::size_t(count));
+            for (std::size_t k = 0; k < m_Triangles.size(); k++)
+                m_Triangles[k] = int(std::lower_bound(m_Global.begin(), m_Global.end(), triangles[k]) - m_Global.begin());
+
+            //! Flat adjacency: the triangles of the vertex v are m_Incident[m_First[v], m_First[v] + m_Degree[v]).
+            //! A collapse appends the triangles left around the merged vertex at the end, a tile grows by
+            //! about a dozen entries per collapse.
+            m_First.assign(n, 0);
+            m_Degree.assign(n, 0);
+            for (int v : m_Triangles)
+                m_Degree[v]++;
+            for (int v = 1; v < n; v++)
+                m_First[v] = m_First[v - 1] + m_Degree[v - 1];
+            m_Incident.resize(m_Triangles.size());
+            std::vector<int> cursor(m_First);
+            for (std::size_t k = 0; k < m_Triangles.size(); k++)
+                m_Incident[cursor[m_Triangles[k]]++] = int(k / 3);
+
+            m_Alive.assign(count, 1);
+            m_State.assign(n, 0);
+            m_Stamps.assign(n, 0);
+
+            m_Positions.resize(n);
+            for (int v = 0; v < n; v++)
+                m_Positions[v] = positions[m_Global[v]];
+
+            m_Quadrics.resize(n);
+            for (int t = 0; t < count; t++)
+            {
+                const vec3 &a = m_Positions[m_Triangles[3 * t]];
+                const vec3 nt = normal(a, m_Positions[m_Triangles[3 * t + 1]], m_Positions[m_Triangles[3 * t + 2]]);
+                const double l = std::sqrt(double(nt.x) * nt.x + double(nt.y) * nt.y + double(nt.z) * nt.z);
+                if (l <= 0.0)
+                    continue;
+
+                const double x = nt.x / l, y = nt.y / l, z = nt.z / l;
+                const double d = -(x * a.x + y * a.y + z * a.z);
+                for (int k = 0; k < 3; k++)
+                    m_Quadrics[m_Triangles[3 * t + k]].AddPlane(x, y, z, d, 0.5 * l);
+            }
+
+            //! An edge with a single triangle in the tile is on its border or on the border of the mesh
+            std::vector<int> around;
+            for (int v = 0; v < n; v++)
+            {
+                around.clear();
+                for (int i = m_First[v]; i < m_First[v] + m_Degree[v]; i++)
+                    for (int k = 0; k < 3; k++)
+                        if (m_Triangles[3 * m_Incident[i] + k] != v)
+                            around.push_back(m_Triangles[3 * m_Incident[i] + k]);
+
+                std::sort(around.begin(), around.end());
+                for (std::size_t i = 0; i < around.size(); i++)
+                {
+                    const bool single = (i == 0 || around[i - 1] != around[i]) && (i + 1 == around.size() || around[i + 1] != around[i]);
+                    if (single)
+                    {
+                        m_State[v] = LOCKED;
+                        break;
+                    }
+                }
+            }
+        }
+
+        void Run(int target, double tolerance)
+        {
+            for (int u = 0; u < int(m_Positions.size()); u++)
+                Evaluate(u);
+
+            while (m_Left > target && !m_Heap.empty())
+            {
+                const Collapse c = m_Heap.top();
+                m_Heap.pop();
+                if (m_State[c.u] != 0 || m_Stamps[c.u] != c.stamp)
+                    continue;
+                if (c.error > tolerance)
+                    break;
+
+                //! Pushed unchecked, or checked before a collapse nearby
+                Neighbors(c.u, m_Around);
+                if (!Valid(c.u, c.v, c.p))
+                {
+                    Evaluate(c.u, true);
+                    continue;
+                }
+
+                Apply(c.u, c.v, c.p);
+            }
+        }
+
+        //! Write the triangles left, and the positions of the vertices that moved.
+        void Write(std::vector<vec3> &positions, std::vector<unsigned> &triangles) const
+        {
+            triangles.clear();
+            triangles.reserve(3 * std::size_t(m_Left));
+            for (int t = 0; t < m_Count; t++)
+                if (m_Alive[t])
+                    for (int k = 0; k < 3; k++)
+                        triangles.push_back(m_Global[m_Triangles[3 * t + k]]);
+
+            for (std::size_t v = 0; v < m_Positions.size(); v++)
+                if (m_State[v] == 0)
+                    positions[m_Global[v]] = m_Positions[v];
+        }
+
+    private:
+        static constexpr std::uint8_t LOCKED = 1;
+        static constexpr std::uint8_t REMOVED = 2;
+
+        template <typename F>
+        void ForTriangles(int v, F &&f) const
+        {
+            for (int i = m_First[v]; i < m_First[v] + m_Degree[v]; i++)
+                if (m_Alive[m_Incident[i]])
+                    f(m_Incident[i]);
+        }
+
+        void Neighbors(int v, std::vector<int> &around) const
+        {
+            around.clear();
+            ForTriangles(v, [&](int t) {
+                for (int k = 0; k < 3; k++)
+                    if (m_Triangles[3 * t + k] != v)
+                        around.push_back(m_Triangles[3 * t + k]);
+            });
+            std::sort(around.begin(), around.end());
+            around.erase(std::unique(around.begin(), around.end()), around.end());
+        }
+
+        //! Triangles around w, but those around the edge (w, other), do not flip when w moves to p.
+        bool Flips(int w, int other, const vec3 &p) const
+        {
+            bool flips = false;
+            ForTriangles(w, [&](int t) {
+                const int *tri = &m_Triangles[3 * t];
+                if (flips || tri[0] == other || tri[1] == other || tri[2] == other)
+                    return;
+
+                vec3 moved[3];
+                for (int k = 0; k < 3; k++)
+                    moved[k] = (tri[k] == w) ? p : m_Positions[tri[k]];
+
+                //! Height field meshes: a triangle must not fold over in the xz plane either
+                const vec3 before = normal(m_Positions[tri[0]], m_Positions[tri[1]], m_Positions[tri[2]]);
+                const vec3 after = normal(moved[0], moved[1], moved[2]);
+                flips = before.x * after.x + before.y * after.y + before.z * after.z <= 0.f || before.y * after.y <= 0.f;
+            });
+            return flips;
+        }
+
+        //! Link condition (the vertices around both u and v are those of the triangles of the edge) and
+        //! no flipped triangle. m_Around holds the neighbors of u.
+        bool Valid(int u, int v, const vec3 &p)
+        {
+            Neighbors(v, m_Others);
+            int common = 0;
+            for (std::size_t i = 0, j = 0; i < m_Around.size() && j < m_Others.size();)
+            {
+                if (m_Around[i] < m_Others[j])
+                    i++;
+                else if (m_Others[j] < m_Around[i])
+                    j++;
+                else
+                    common++, i++, j++;
+            }
+
+            int shared = 0;
+            ForTriangles(u, [&](int t) { shared += (m_Triangles[3 * t] == v || m_Triangles[3 * t + 1] == v || m_Triangles[3 * t + 2] == v); });
+            if (common != shared)
+                return false;
+
+            //! An edge between two locked vertices may exist in the next tile: never create one
+            if (m_State[v] == LOCKED)
+                for (int w : m_Around)
+                    if (w != v && m_State[w] == LOCKED && !std::binary_search(m_Others.begin(), m_Others.end(), w))
+                        return false;
+
+            return !Flips(u, v, p) && !Flips(v, u, p);
+        }
+
+        //! Push the cheapest collapse of u into one of its neighbors. The checks are the expensive part,
+        //! they are left to the pop unless the cheapest collapse was found invalid there.
+        void Evaluate(int u, bool checked = false)
+        {
+            if (m_State[u] != 0)
+                return;
+            m_Stamps[u]++;
+
+            //! Valid only overwrites m_Others
+            Neighbors(u, m_Around);
+
+            m_Candidates.clear();
+            for (int v : m_Around)
+            {
+                const Quadric q = m_Quadrics[u] + m_Quadrics[v];
+                vec3 p = m_Positions[v];
+                if (m_State[v] != LOCKED && !q.Minimum(p))
+                {
+                    const vec3 &a = m_Positions[u], &b = m_Positions[v];
+                    const vec3 mid(0.5f * (a.x + b.x), 0.5f * (a.y + b.y), 0.5f * (a.z + b.z));
+                    for (const vec3 &candidate : {a, mid})
+                        if (q.Error(candidate) < q.Error(p))
+                            p = candidate;
+                }
+                m_Candidates.push_back({q.Error(p), u, v, m_Stamps[u], p});
+            }
+
+            if (m_Candidates.empty())
+                return;
+            if (!checked)
+            {
+                m_Heap.push(*std::min_element(m_Candidates.begin(), m_Candidates.end(), [](const Collapse &a, const Collapse &b) { return a.error < b.error; }));
+                return;
+            }
+
+            std::sort(m_Candidates.begin(), m_Candidates.end(), [](const Collapse &a, const Collapse &b) { return a.error < b.error; });
+            for (const Collapse &c : m_Candidates)
+            {
+                if (Valid(u, c.v, c.p))
+                {
+                    m_Heap.push(c);
+                    return;
+                }
+            }
+        }
+
+        void Apply(int u, int v, const vec3 &p)
+        {
+            ForTriangles(u, [&](int t) {
+                int *tri = &m_Triangles[3 * t];
+                if (tri[0] == v || tri[1] == v || tri[2] == v)
+                {
+                    m_Alive[t] = 0;
+                    m_Left--;
+                    return;
+                }
+                for (int k = 0; k < 3; k++)
+                    if (tri[k] == u)
+                        tri[k] = v;
+            });
+
+            const int first = int(m_Incident.size());
+            for (int w : {v, u})
+                ForTriangles(w, [&](int t) { m_Incident.push_back(t); });
+            m_First[v] = first;
+            m_Degree[v] = int(m_Incident.size()) - first;
+
+            m_Quadrics[v] += m_Quadrics[u];
+            m_Positions[v] = p;
+            m_State[u] = REMOVED;
+
+            Evaluate(v);
+            Neighbors(v, m_Changed);
+            for (int w : m_Changed)
+                Evaluate(w);
+        }
+
+    private:
+        int m_Count, m_Left;
+
+        std::vector<unsigned> m_Global; //! Global index of the local vertices
+        std::vector<int> m_Triangles;
+        std::vector<std::uint8_t> m_Alive;
+
+        std::vector<int> m_First, m_Degree, m_Incident;
+
+        std::vector<vec3> m_Positions;
+        std::vector<Quadric> m_Quadrics;
+        std::vector<std::uint8_t> m_State;
+        std::vector<unsigned> m_Stamps; //! Collapses pushed with an older stamp are stale
+
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> m_Heap;
+        std::vector<int> m_Around, m_Others, m_Changed;
+        std::vector<Collapse> m_Candidates;
+    };
+} // namespace
+
+namespace mmv
+{
+    std::size_t decimate(std::vector<vec3> &positions, std::vector<unsigned> &indices, std::size_t max_triangles, scalar_t max_error,
+                         int tile_triangles)
+    {
+        if (max_triangles == 0 && max_error <= 0.f)
+            return indices.size() / 3;
+
+        const double tolerance = max_error > 0.f ? double(max_error) * max_error : std::numeric_limits<double>::max();
+
+        vec2 lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        vec2 hi(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest());
+        for (const vec3 &p : positions)
+        {
+            lo = vec2(std::min(lo.x, p.x), std::min(lo.y, p.z));
+            hi = vec2(std::max(hi.x, p.x), std::max(hi.y, p.z));
+        }
+
+        //! Passes alternate between aligned and shifted tiles, fewer as the mesh shrinks, until the budget
+        //! is met or a pass removes less than 1% of the triangles
+        std::vector<unsigned> sorted;
+        for (int pass = 0;; pass++)
+        {
+            const std::size_t count = indices.size() / 3;
+            if (count == 0 || (max_triangles > 0 && count <= max_triangles))
+                break;
+
+            //! Tiles by the centroid of the triangles, shifted by half a tile on odd passes
+            const int tiles = std::max(1, int(std::ceil(std::sqrt(double(count) / std::max(tile_triangles, 1)))));
+            const int n = tiles + pass % 2;
+            const float sx = std::max(hi.x - lo.x, 1e-6f) / tiles, sz = std::max(hi.y - lo.y, 1e-6f) / tiles;
+            const float shift = 0.5f * (pass % 2);
+
+            std::vector<int> tile(count);
+            std::vector<std::size_t> first(std::size_t(n) * n + 1, 0);
+            for (std::size_t t = 0; t < count; t++)
+            {
+                const vec3 &a = positions[indices[3 * t]], &b = positions[indices[3 * t + 1]], &c = positions[indices[3 * t + 2]];
+                const int i = std::clamp(int(((a.x + b.x + c.x) / 3.f - lo.x) / sx + shift), 0, n - 1);
+                const int j = std::clamp(int(((a.z + b.z + c.z) / 3.f - lo.y) / sz + shift), 0, n - 1);
+                tile[t] = j * n + i;
+                first[tile[t] + 1]++;
+            }
+            for (std::size_t k = 0; k + 1 < first.size(); k++)
+                first[k + 1] += first[k];
+
+            sorted.resize(indices.size());
+            std::vector<std::size_t> cursor(first.begin(), first.end() - 1);
+            for (std::size_t t = 0; t < count; t++)
+            {
+                const std::size_t k = cursor[tile[t]]++;
+                std::copy_n(&indices[3 * t], 3, &sorted[3 * k]);
+            }
+
+            //! Every tile gets the same share of the budget, rounded so that the shares sum up to it
+            auto share = [&](std::size_t k) { return std::uint64_t(first[k]) * max_triangles / count; };
+            std::vector<std::vector<unsigned>> simplified(std::size_t(n) * n);
+            parallel_for(0, n * n, [&](int begin, int end) {
+                for (int k = begin; k < end; k++)
+                {
+                    const int size = int(first[k + 1] - first[k]);
+                    if (size == 0)
+                        continue;
+
+                    TileDecimation decimation(positions, &sorted[3 * first[k]], size);
+                    decimation.Run(int(share(k + 1) - share(k)), tolerance);
+                    decimation.Write(positions, simplified[k]);
+                }
+            });
+
+            indices.clear();
+            for (const std::vector<unsigned> &triangles : simplified)
+                indices.insert(indices.end(), triangles.begin(), triangles.end());
+
+            //! A single tile has nothing left to unlock
+            if (n == 1 || 100 * (count - indices.size() / 3) < count)
+                break;
+        }
+
+        //! Drop the vertices collapsed away
+        std::vector<unsigned> remap(positions.size(), ~0u);
+        std::vector<vec3> used;
+        for (unsigned &v : indices)
+        {
+            if (remap[v] == ~0u)
+            {
+                remap[v] = unsigned(used.size());
+                used.push_back(positions[v]);
+            }
+            v = remap[v];
+        }
+        positions = std::move(used);
+
+        return indices.size() / 3;
+    }
+} // namespace mmv
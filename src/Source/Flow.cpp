@@ -0,0 +1,796 @@
+#include "Flow.h"
+
+#include "Parallel.h"
+#include "RadixHeap.h"
+
+#include <bit>
+
+namespace
+{
+    //! Same neighbour order as the breaching, the first steepest neighbour wins ties.
+    const int DIRECTIONS = 8;
+    const int dx[DIRECTIONS] = {-1, -1, 0, 1, 1, 1, 0, -1};
+    const int dy[DIRECTIONS] = {0, -1, -1, -1, 0, 1, 1, 1};
+
+    //! Rows handled by a single parallel_for chunk at least.
+    const int ROW_GRAIN = 16;
+
+    //! Cells handled by a single parallel_for chunk at least.
+    const int CELL_GRAIN = 4096;
+
+    //! D-infinity facets: a cardinal neighbour and one of the diagonal neighbours next to it.
+    const int FACETS = 8;
+    const int facet_cardinal[FACETS] = {0, 0, 2, 2, 4, 4, 6, 6};
+    const int facet_diagonal[FACETS] = {1, 7, 1, 3, 3, 5, 5, 7};
+
+    //! atan(x) for x >= 0, polynomial approximation (absolute error below 1e-5).
+    inline scalar_t arctan(scalar_t x)
+    {
+        const bool inverse = x > 1.f;
+        const scalar_t t = inverse ? 1.f / x : x;
+        const scalar_t t2 = t * t;
+        const scalar_t a = t * (0.99997726f + t2 * (-0.33262347f + t2 * (0.19354346f + t2 * (-0.11643287f + t2 * (0.05265332f + t2 * -0.01172120f)))));
+        return inverse ? 1.57079633f - a : a;
+    }
+
+    void receiver_rows(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, index_t *receivers, int first, int last)
+    {
+        scalar_t inverse_distance[DIRECTIONS];
+        int offset[DIRECTIONS];
+        for (int n = 0; n < DIRECTIONS; ++n)
+        {
+            inverse_distance[n] = 1.f / std::sqrt(dx[n] * dx[n] * cx * cx + dy[n] * dy[n] * cy * cy);
+            offset[n] = dy[n] * nx + dx[n];
+        }
+
+        for (int j = first; j < last; ++j)
+        {
+            //! Border cells are outlets
+            for (int i = 0; i < nx; ++i)
+                receivers[j * nx + i] = j * nx + i;
+
+            if (j == 0 || j == ny - 1)
+                continue;
+
+            for (int i = 1; i < nx - 1; ++i)
+            {
+                const index_t idx = j * nx + i;
+
+                //! Branch-free selection, the first steepest neighbour wins ties
+                scalar_t steepest = 0.f;
+                index_t receiver = idx;
+                for (int n = 0; n < DIRECTIONS; ++n)
+                {
+                    const scalar_t slope = (h[idx] - h[idx + offset[n]]) * inverse_distance[n];
+                    const bool steeper = slope > steepest;
+                    steepest = steeper ? slope : steepest;
+                    receiver = steeper ? idx + offset[n] : receiver;
+                }
+                receivers[idx] = receiver;
+            }
+        }
+    }
+
+    //! Donor count and donor mask (bit n set when neighbour n drains into the cell).
+    void donor_rows(const index_t *receivers, int nx, int ny, int *donors, std::uint8_t *upstream, int first, int last)
+    {
+        int offset[DIRECTIONS];
+        for (int n = 0; n < DIRECTIONS; ++n)
+            offset[n] = dy[n] * nx + dx[n];
+
+        auto border = [&](int i, int j) {
+            const index_t idx = j * nx + i;
+
+            unsigned mask = 0;
+            for (int n = 0; n < DIRECTIONS; ++n)
+            {
+                const int pi = i + dx[n];
+                const int pj = j + dy[n];
+                if (pi >= 0 && pi < nx && pj >= 0 && pj < ny && receivers[pj * nx + pi] == idx)
+                    mask |= 1u << n;
+            }
+            upstream[idx] = std::uint8_t(mask);
+            donors[idx] = std::popcount(mask);
+        };
+
+        for (int j = first; j < last; ++j)
+        {
+            if (j == 0 || j == ny - 1 || nx < 3)
+            {
+                for (int i = 0; i < nx; ++i)
+                    border(i, j);
+                continue;
+            }
+
+            border(0, j);
+            for (int i = 1; i < nx - 1; ++i)
+            {
+                const index_t idx = j * nx + i;
+
+                unsigned mask = 0;
+                for (int n = 0; n < DIRECTIONS; ++n)
+                    mask |= unsigned(receivers[idx + offset[n]] == idx) << n;
+
+                upstream[idx] = std::uint8_t(mask);
+                donors[idx] = std::popcount(mask);
+            }
+            border(nx - 1, j);
+        }
+    }
+
+    //! Walks with a single thread run faster without the atomic donor counts of downstream_walk.
+    bool single_thread(flow::Execution policy, int threads)
+    {
+        return policy == flow::Execution::SEQUENTIAL || threads == 1 || ThreadPool::instance().size() == 1;
+    }
+
+    //! body(first, last) over the rows, on the calling thread or split over the pool.
+    template <typename Body>
+    void for_rows(flow::Execution policy, int ny, int threads, Body &&body)
+    {
+        if (policy == flow::Execution::SEQUENTIAL)
+            body(0, ny);
+        else
+            parallel_for(0, ny, body, threads, ROW_GRAIN);
+    }
+
+    //! body(first, last) over the cells, on the calling thread or split over the pool.
+    template <typename Body>
+    void for_cells(flow::Execution policy, int n, int threads, Body &&body)
+    {
+        if (policy == flow::Execution::SEQUENTIAL)
+            body(0, n);
+        else
+            parallel_for(0, n, body, threads, CELL_GRAIN);
+    }
+
+    //! Pull the values of the donors of c (final by then) into values[c], in neighbour order.
+    //! The sum only depends on the routing, not on the order the cells are visited in.
+    inline void gather(const flow::Routing &routing, index_t c, scalar_t *values)
+    {
+        scalar_t sum = values[c];
+        for (unsigned mask = routing.upstream[c]; mask != 0; mask &= mask - 1)
+        {
+            const int n = std::countr_zero(mask);
+            sum += values[c + dy[n] * routing.nx + dx[n]];
+        }
+        values[c] = sum;
+    }
+
+    //! Visit every cell once all its donors have been visited, on several threads.
+    //!
+    //! Each thread starts from the sources of its chunk and walks downstream. Every cell keeps
+    //! an atomic count of the donors not yet visited: the thread that visits the last donor
+    //! carries on with the receiver, the others stop there. No cell waits and no lock is taken.
+    template <typename Visit>
+    void downstream_walk(const index_t *receivers, const int *donors, int n, Visit &&visit, int threads)
+    {
+        std::vector<std::atomic<int>> remaining(n);
+        parallel_for(0, n, [&](int first, int last) {
+            for (int c = first; c < last; ++c)
+                remaining[c].store(donors[c], std::memory_order_relaxed);
+        }, threads, CELL_GRAIN);
+
+        parallel_for(0, n, [&](int first, int last) {
+            for (int s = first; s < last; ++s)
+            {
+                if (donors[s] != 0)
+                    continue;
+
+                index_t c = s;
+                while (true)
+                {
+                    visit(c);
+
+                    const index_t r = receivers[c];
+                    //! acq_rel: the last donor sees the work done on the other branches
+                    if (r == c || remaining[r].fetch_sub(1, std::memory_order_acq_rel) != 1)
+                        break;
+                    c = r;
+                }
+            }
+        }, threads, CELL_GRAIN);
+    }
+} // namespace
+
+namespace flow
+{
+    void d8_receivers(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, index_t *receivers, Execution policy, int threads)
+    {
+        if (policy == Execution::SEQUENTIAL)
+        {
+            receiver_rows(h, nx, ny, cx, cy, receivers, 0, ny);
+            return;
+        }
+
+        parallel_for(0, ny, [&](int first, int last) { receiver_rows(h, nx, ny, cx, cy, receivers, first, last); }, threads, ROW_GRAIN);
+    }
+
+    void flat_mask(const scalar_t *h, int nx, int ny, const index_t *receivers, std::vector<int> &labels, std::vector<int> &mask,
+                   Execution policy, int threads)
+    {
+        const int n = nx * ny;
+
+        //! Border cells are outlets, they drain out of the grid
+        auto drains = [&](int i, int j) { return i == 0 || i == nx - 1 || j == 0 || j == ny - 1 || receivers[j * nx + i] != j * nx + i; };
+
+        //! Interior cells without receiver, and their edges: the cells next to them at the same elevation
+        //! which drain (low edges) and the ones next to a higher neighbour (high edges). Collected per row,
+        //! then concatenated in row order: the edges are the same for both policies.
+        std::vector<std::vector<index_t>> row_low(ny), row_high(ny);
+        for_rows(policy, ny, threads, [&](int first, int last) {
+            for (int j = std::max(first, 1); j < std::min(last, ny - 1); ++j)
+            {
+                for (int i = 1; i < nx - 1; ++i)
+                {
+                    const index_t c = j * nx + i;
+                    if (receivers[c] != c)
+                        continue;
+
+                    bool high = false;
+                    for (int k = 0; k < DIRECTIONS; ++k)
+                    {
+                        const index_t q = (j + dy[k]) * nx + i + dx[k];
+                        if (h[q] > h[c])
+                            high = true;
+                        else if (h[q] == h[c] && drains(i + dx[k], j + dy[k]))
+                            row_low[j].push_back(q);
+                    }
+                    if (high)
+                        row_high[j].push_back(c);
+                }
+            }
+        });
+
+        std::vector<index_t> low_edges, high_edges;
+        for (int j = 0; j < ny; ++j)
+        {
+            low_edges.insert(low_edges.end(), row_low[j].begin(), row_low[j].end());
+            high_edges.insert(high_edges.end(), row_high[j].begin(), row_high[j].end());
+        }
+
+        labels.assign(n, 0);
+        mask.assign(n, 0);
+        if (low_edges.empty())
+            return;
+
+        //! Label the flats from their low edges, across every cell at the same elevation. Flats
+        //! without a low edge stay unlabelled: they are pits and keep no receiver.
+        //! The plateaus of equal elevations are found with a lock-free union-find, every link going
+        //! from the larger root to the smaller one: each plateau ends with its lowest index as root,
+        //! whatever the schedule. Labels are then numbered in the order of the low edges.
+        std::vector<index_t> parent(n);
+        //! Path halving: any ancestor is a valid parent, so concurrent halvings only shorten the paths
+        auto find = [&](index_t c) {
+            while (true)
+            {
+                const index_t p = std::atomic_ref<index_t>(parent[c]).load(std::memory_order_relaxed);
+                if (p == c)
+                    return c;
+
+                const index_t g = std::atomic_ref<index_t>(parent[p]).load(std::memory_order_relaxed);
+                if (g != p)
+                    std::atomic_ref<index_t>(parent[c]).store(g, std::memory_order_relaxed);
+                c = g;
+            }
+        };
+        auto unite = [&](index_t a, index_t b) {
+            while (true)
+            {
+                a = find(a);
+                b = find(b);
+                if (a == b)
+                    return;
+                if (a < b)
+                    std::swap(a, b);
+
+                index_t expected = a;
+                if (std::atomic_ref<index_t>(parent[a]).compare_exchange_weak(expected, b, std::memory_order_relaxed))
+                    return;
+            }
+        };
+
+        //! Runs of equal elevations along the rows first, every row on its own: a cell points to the start
+        //! of its run. Then the links to the next row, the other half of the 8-neighbourhood.
+        for_rows(policy, ny, threads, [&](int first, int last) {
+            for (int j = first; j < last; ++j)
+            {
+                const index_t row = j * nx;
+                parent[row] = row;
+                for (int i = 1; i < nx; ++i)
+                    parent[row + i] = h[row + i] == h[row + i - 1] ? parent[row + i - 1] : row + i;
+            }
+        });
+
+        for_rows(policy, ny - 1, threads, [&](int first, int last) {
+            for (int j = first; j < last; ++j)
+            {
+                const index_t row = j * nx;
+                for (int i = 0; i < nx; ++i)
+                {
+                    const index_t c = row + i;
+                    for (int k = std::max(i - 1, 0); k <= std::min(i + 1, nx - 1); ++k)
+                    {
+                        //! Cells of the same run below reach the same root, link the first one only
+                        const index_t q = row + nx + k;
+                        if (h[q] == h[c] && (k == std::max(i - 1, 0) || h[q - 1] != h[q]))
+                            unite(c, q);
+                    }
+                }
+            }
+        });
+
+        //! A root belongs to its own plateau: its label is the one of the plateau
+        int label_count = 0;
+        for (const index_t e : low_edges)
+        {
+            const index_t root = find(e);
+            if (labels[root] == 0)
+                labels[root] = ++label_count;
+        }
+
+        for_cells(policy, n, threads, [&](int first, int last) {
+            for (index_t c = first; c < last; ++c)
+            {
+                if (parent[c] != c)
+                    labels[c] = labels[find(c)];
+            }
+        });
+
+        //! Edges grouped by label, in their original order
+        auto group = [&](const std::vector<index_t> &edges, std::vector<int> &first, std::vector<index_t> &grouped) {
+            first.assign(label_count + 2, 0);
+            for (const index_t c : edges)
+                ++first[labels[c] + 1];
+            for (int l = 0; l <= label_count; ++l)
+                first[l + 1] += first[l];
+
+            grouped.resize(edges.size());
+            std::vector<int> cursor(first.begin(), first.end() - 1);
+            for (const index_t c : edges)
+                grouped[cursor[labels[c]]++] = c;
+        };
+
+        std::vector<int> low_first, high_first;
+        std::vector<index_t> low_grouped, high_grouped;
+        group(low_edges, low_first, low_grouped);
+        group(high_edges, high_first, high_grouped);
+
+        //! The flats are independent: both breadth-first passes run flat by flat, in parallel. The
+        //! distances do not depend on the order of the seeds, so the mask is the same for both policies.
+        auto flats = [&](int first_label, int last_label) {
+            std::vector<index_t> current, next;
+
+            //! Breadth-first pass over the cells of one flat, one level per loop, calling visit(c, loops)
+            //! when c is first reached: cells are marked as they are queued, and queued once
+            auto breadth_first = [&](const index_t *begin, const index_t *end, auto &&visited, auto &&visit) {
+                current.clear();
+                for (const index_t *e = begin; e != end; ++e)
+                {
+                    if (!visited(*e))
+                    {
+                        visit(*e, 1);
+                        current.push_back(*e);
+                    }
+                }
+
+                for (int loops = 2; !current.empty(); ++loops)
+                {
+                    next.clear();
+                    for (const index_t c : current)
+                    {
+                        const int i = c % nx, j = c / nx;
+                        for (int k = 0; k < DIRECTIONS; ++k)
+                        {
+                            const int pi = i + dx[k], pj = j + dy[k];
+                            if (pi < 0 || pi >= nx || pj < 0 || pj >= ny)
+                                continue;
+
+                            const index_t q = pj * nx + pi;
+                            if (labels[q] == labels[c] && !drains(pi, pj) && !visited(q))
+                            {
+                                visit(q, loops);
+                                next.push_back(q);
+                            }
+                        }
+                    }
+                    current.swap(next);
+                }
+            };
+
+            for (int l = first_label; l < last_label; ++l)
+            {
+                //! Gradient away from higher terrain, from the high edges, kept negative
+                int flat_height = 0;
+                breadth_first(high_grouped.data() + high_first[l], high_grouped.data() + high_first[l + 1],
+                              [&](index_t c) { return mask[c] < 0; }, [&](index_t c, int loops) {
+                                  mask[c] = -loops;
+                                  flat_height = loops;
+                              });
+
+                //! Gradient towards lower terrain, from the low edges, combined with the first one: twice the
+                //! distance to the outlet, plus the distance to the top of the gradient away from higher terrain.
+                //! Visited cells become positive.
+                breadth_first(low_grouped.data() + low_first[l], low_grouped.data() + low_first[l + 1],
+                              [&](index_t c) { return mask[c] > 0; }, [&](index_t c, int loops) {
+                                  mask[c] = (mask[c] < 0 ? flat_height + mask[c] : 0) + 2 * loops;
+                              });
+            }
+        };
+
+        if (policy == Execution::SEQUENTIAL)
+            flats(1, label_count + 1);
+        else
+            parallel_for(1, label_count + 1, flats, threads);
+    }
+
+    void resolve_flats(const scalar_t *h, int nx, int ny, index_t *receivers, Execution policy, int threads)
+    {
+        //! Nothing to do when every interior cell drains
+        std::atomic<bool> any{false};
+        for_rows(policy, ny, threads, [&](int first, int last) {
+            for (int j = std::max(first, 1); j < std::min(last, ny - 1) && !any.load(std::memory_order_relaxed); ++j)
+            {
+                for (int i = 1; i < nx - 1; ++i)
+                {
+                    if (receivers[j * nx + i] == j * nx + i)
+                    {
+                        any.store(true, std::memory_order_relaxed);
+                        break;
+                    }
+                }
+            }
+        });
+        if (!any.load())
+            return;
+
+        std::vector<int> labels, mask;
+        flat_mask(h, nx, ny, receivers, labels, mask, policy, threads);
+
+        for_rows(policy, ny, threads, [&](int first, int last) {
+            for (int j = std::max(first, 1); j < std::min(last, ny - 1); ++j)
+            {
+                for (int i = 1; i < nx - 1; ++i)
+                {
+                    //! Interior cell of a flat (border cells are outlets): lowest neighbour on the mask, the first one wins ties
+                    const index_t c = j * nx + i;
+                    if (receivers[c] != c || labels[c] == 0 || mask[c] <= 0)
+                        continue;
+
+                    int lowest = mask[c];
+                    for (int k = 0; k < DIRECTIONS; ++k)
+                    {
+                        const index_t q = (j + dy[k]) * nx + i + dx[k];
+                        if (labels[q] == labels[c] && mask[q] > 0 && mask[q] < lowest)
+                        {
+                            lowest = mask[q];
+                            receivers[c] = q;
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    void donor_counts(const index_t *receivers, int nx, int ny, int *donors, std::uint8_t *upstream, Execution policy, int threads)
+    {
+        if (policy == Execution::SEQUENTIAL)
+        {
+            donor_rows(receivers, nx, ny, donors, upstream, 0, ny);
+            return;
+        }
+
+        parallel_for(0, ny, [&](int first, int last) { donor_rows(receivers, nx, ny, donors, upstream, first, last); }, threads, ROW_GRAIN);
+    }
+
+    void topological_order(const index_t *receivers, const int *donors, int n, index_t *order, Execution policy, int threads)
+    {
+        if (!single_thread(policy, threads))
+        {
+            std::atomic<int> tail{0};
+            downstream_walk(receivers, donors, n, [&](index_t c) { order[tail.fetch_add(1, std::memory_order_relaxed)] = c; }, threads);
+            assert(tail.load() == n);
+            return;
+        }
+
+        std::vector<int> remaining(donors, donors + n);
+
+        //! The order doubles as the FIFO: sources first, then each cell once its last donor is placed
+        int tail = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (remaining[i] == 0)
+                order[tail++] = i;
+        }
+
+        for (int head = 0; head < tail; ++head)
+        {
+            const index_t c = order[head];
+            const index_t r = receivers[c];
+            if (r != c && --remaining[r] == 0)
+                order[tail++] = r;
+        }
+
+        assert(tail == n);
+    }
+
+    void route(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, Routing &routing, Execution policy, int threads)
+    {
+        const int n = nx * ny;
+
+        routing.nx = nx;
+        routing.ny = ny;
+        routing.receivers.resize(n);
+        routing.donors.resize(n);
+        routing.upstream.resize(n);
+        routing.order.resize(n);
+
+        d8_receivers(h, nx, ny, cx, cy, routing.receivers.data(), policy, threads);
+        resolve_flats(h, nx, ny, routing.receivers.data(), policy, threads);
+        donor_counts(routing.receivers.data(), nx, ny, routing.donors.data(), routing.upstream.data(), policy, threads);
+        topological_order(routing.receivers.data(), routing.donors.data(), n, routing.order.data(), policy, threads);
+    }
+
+    void accumulate(const Routing &routing, scalar_t *values, Execution policy, int threads)
+    {
+        if (!single_thread(policy, threads))
+        {
+            const int n = int(routing.receivers.size());
+            downstream_walk(routing.receivers.data(), routing.donors.data(), n, [&](index_t c) { gather(routing, c, values); }, threads);
+            return;
+        }
+
+        for (const index_t c : routing.order)
+            gather(routing, c, values);
+    }
+
+    void elevation_order(const scalar_t *h, int n, std::vector<index_t> &order)
+    {
+        //! (key << 32 | index), the key decreasing with the elevation. Three stable passes of
+        //! 11 bits on the key keep equal elevations in index order.
+        const int BITS = 11;
+        const int BUCKETS = 1 << BITS;
+
+        std::vector<std::uint64_t> items(n), sorted(n);
+        for (int i = 0; i < n; ++i)
+            items[i] = std::uint64_t(~order_key(h[i])) << 32 | std::uint32_t(i);
+
+        std::vector<int> offsets(BUCKETS);
+        for (int shift = 32; shift < 64; shift += BITS)
+        {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            for (const std::uint64_t item : items)
+                ++offsets[(item >> shift) & (BUCKETS - 1)];
+
+            int sum = 0;
+            for (int &offset : offsets)
+            {
+                const int count = offset;
+                offset = sum;
+                sum += count;
+            }
+
+            for (const std::uint64_t item : items)
+                sorted[offsets[(item >> shift) & (BUCKETS - 1)]++] = item;
+            items.swap(sorted);
+        }
+
+        order.resize(n);
+        for (int i = 0; i < n; ++i)
+            order[i] = index_t(items[i] & 0xffffffffu);
+    }
+
+    void accumulate_mfd(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, scalar_t *values, scalar_t exponent)
+    {
+        //! Contour lengths of the 8 directions (half a cell side for cardinals, a quarter of the diagonal otherwise),
+        //! folded with the inverse distance in the linear case: weight = contour / distance * drop
+        scalar_t contour[DIRECTIONS], inverse_distance[DIRECTIONS], linear_weight[DIRECTIONS];
+        int offset[DIRECTIONS];
+        for (int n = 0; n < DIRECTIONS; ++n)
+        {
+            const scalar_t distance = std::sqrt(dx[n] * dx[n] * cx * cx + dy[n] * dy[n] * cy * cy);
+            inverse_distance[n] = 1.f / distance;
+            contour[n] = (dx[n] != 0 && dy[n] != 0) ? 0.25f * std::sqrt(cx * cx + cy * cy) : 0.5f * (dx[n] != 0 ? cy : cx);
+            linear_weight[n] = contour[n] * inverse_distance[n];
+            offset[n] = dy[n] * nx + dx[n];
+        }
+
+        const bool linear = exponent == 1.f;
+
+        //! Nothing but outlets
+        if (nx < 3 || ny < 3)
+            return;
+
+        //! Number of higher interior neighbours of every interior cell, row by row and one direction at a
+        //! time so that the loads are contiguous. Border cells are outlets, they pass nothing on: their
+        //! count starts flagged and never drops to zero (they have at most 3 interior neighbours).
+        const std::uint8_t VISITED = 0xff;
+        std::vector<std::uint8_t> higher(nx * ny, VISITED);
+        for (int j = 1; j < ny - 1; ++j)
+        {
+            const scalar_t *row = h + j * nx;
+            std::uint8_t *count = higher.data() + j * nx;
+            std::fill(count + 1, count + nx - 1, 0);
+            for (int n = 0; n < DIRECTIONS; ++n)
+            {
+                if (j + dy[n] < 1 || j + dy[n] > ny - 2)
+                    continue;
+
+                const int o = offset[n];
+                for (int i = std::max(1, 1 - dx[n]); i < std::min(nx - 1, nx - 1 - dx[n]); ++i)
+                    count[i] += std::uint8_t(row[i + o] > row[i]);
+            }
+        }
+
+        //! Spread a cell over its lower neighbours, queueing the interior ones that got their last inflow
+        std::vector<index_t> stack;
+        auto spread = [&](index_t c) {
+            scalar_t weights[DIRECTIONS];
+            scalar_t sum = 0.f;
+            if (linear)
+            {
+                for (int n = 0; n < DIRECTIONS; ++n)
+                {
+                    weights[n] = linear_weight[n] * std::max(0.f, h[c] - h[c + offset[n]]);
+                    sum += weights[n];
+                }
+            }
+            else
+            {
+                for (int n = 0; n < DIRECTIONS; ++n)
+                {
+                    const scalar_t slope = (h[c] - h[c + offset[n]]) * inverse_distance[n];
+                    weights[n] = slope > 0.f ? contour[n] * std::pow(slope, exponent) : 0.f;
+                    sum += weights[n];
+                }
+            }
+
+            const scalar_t share = sum > 0.f ? values[c] / sum : 0.f;
+            for (int n = 0; n < DIRECTIONS; ++n)
+            {
+                const index_t q = c + offset[n];
+                if (h[q] >= h[c])
+                    continue;
+
+                values[q] += weights[n] * share;
+                if (--higher[q] == 0)
+                    stack.push_back(q);
+            }
+        };
+
+        //! Depth-first from the interior cells without higher neighbours: a cell is spread once all its
+        //! higher neighbours are, which visits the terrain downstream without sorting the elevations.
+        //! Visited cells are flagged so that the scan skips them.
+        for (int j = 1; j < ny - 1; ++j)
+        {
+            for (int i = 1; i < nx - 1; ++i)
+            {
+                const index_t s = j * nx + i;
+                if (higher[s] != 0)
+                    continue;
+
+                stack.push_back(s);
+                while (!stack.empty())
+                {
+                    const index_t c = stack.back();
+                    stack.pop_back();
+                    higher[c] = VISITED;
+                    spread(c);
+                }
+            }
+        }
+    }
+
+    void accumulate_dinf(const scalar_t *h, int nx, int ny, scalar_t cx, scalar_t cy, const index_t *order, scalar_t *values)
+    {
+        //! Per facet: cardinal and diagonal offsets, distances and the angle of the diagonal
+        int cardinal[FACETS], diagonal[FACETS];
+        scalar_t d1[FACETS], d2[FACETS], inverse_d1[FACETS], inverse_d2[FACETS], inverse_dd[FACETS], alpha[FACETS];
+        for (int f = 0; f < FACETS; ++f)
+        {
+            const int a = facet_cardinal[f];
+            const int b = facet_diagonal[f];
+            cardinal[f] = dy[a] * nx + dx[a];
+            diagonal[f] = dy[b] * nx + dx[b];
+            d1[f] = dx[a] != 0 ? cx : cy;
+            d2[f] = dx[a] != 0 ? cy : cx;
+            inverse_d1[f] = 1.f / d1[f];
+            inverse_d2[f] = 1.f / d2[f];
+            inverse_dd[f] = 1.f / std::sqrt(cx * cx + cy * cy);
+            alpha[f] = std::atan(d2[f] / d1[f]);
+        }
+
+        //! Steepest facet of every cell and the part of its flow going to the diagonal neighbour.
+        //! Computed row by row, one facet at a time, so that the loads are contiguous and the
+        //! inner loops branch-free: the elevation order only drives the cheap spreading pass.
+        const std::uint8_t NO_FACET = FACETS;
+        std::vector<std::uint8_t> facets(nx * ny, NO_FACET); //! Border cells are outlets
+        std::vector<scalar_t> proportions(nx * ny, 0.f);
+        std::vector<scalar_t> steepest(nx), part(nx), valley(nx);
+        std::vector<int> best(nx), valley_facet(nx);
+
+        for (int j = 1; j < ny - 1; ++j)
+        {
+            const scalar_t *row = h + j * nx;
+
+            std::fill(steepest.begin(), steepest.end(), 0.f);
+            std::fill(best.begin(), best.end(), int(NO_FACET));
+            std::fill(valley.begin(), valley.end(), 0.f);
+            std::fill(valley_facet.begin(), valley_facet.end(), int(NO_FACET));
+
+            for (int f = 0; f < FACETS; ++f)
+            {
+                for (int i = 1; i < nx - 1; ++i)
+                {
+                    const scalar_t e0 = row[i];
+                    const scalar_t e1 = row[i + cardinal[f]];
+                    const scalar_t e2 = row[i + diagonal[f]];
+                    const scalar_t s1 = (e0 - e1) * inverse_d1[f];
+                    const scalar_t s2 = (e1 - e2) * inverse_d2[f];
+                    const scalar_t sd = (e0 - e2) * inverse_dd[f];
+
+                    //! Flow along the cardinal edge, the diagonal edge, or inside the facet (part < 0). The angle
+                    //! atan(s2 / s1) is clamped to 0 when negative (Tarboton 1997): a facet whose cardinal neighbour
+                    //! is higher gets the slope s1 and does not compete. s1 = 0 is the limit towards the diagonal.
+                    const bool along_cardinal = s2 <= 0.f || s1 < 0.f;
+                    const bool along_diagonal = !along_cardinal && s2 * d1[f] > s1 * d2[f];
+
+                    //! Steepest drop to a diagonal between two higher cardinals, used by the cells no facet drains
+                    const scalar_t notch = s1 < 0.f && sd > 0.f ? sd * sd : 0.f;
+                    const bool deeper = notch > valley[i];
+                    valley[i] = deeper ? notch : valley[i];
+                    valley_facet[i] = deeper ? f : valley_facet[i];
+
+                    //! Squared slopes, only positive ones compete
+                    const scalar_t squared = along_cardinal ? (s1 > 0.f ? s1 * s1 : 0.f)
+                                           : along_diagonal ? (sd > 0.f ? sd * sd : 0.f)
+                                                            : s1 * s1 + s2 * s2;
+
+                    const bool steeper = squared > steepest[i];
+                    steepest[i] = steeper ? squared : steepest[i];
+                    best[i] = steeper ? f : best[i];
+                    part[i] = steeper ? (along_cardinal ? 0.f : along_diagonal ? 1.f : -1.f) : part[i];
+                }
+            }
+
+            //! The angle is only computed for the chosen facet. A cell at the bottom of a one cell wide
+            //! diagonal valley has no facet left, it drains along the steepest diagonal rather than being a sink.
+            for (int i = 1; i < nx - 1; ++i)
+            {
+                if (best[i] == NO_FACET)
+                {
+                    best[i] = valley_facet[i];
+                    part[i] = 1.f;
+                }
+
+                const int f = best[i];
+                if (f == NO_FACET)
+                    continue;
+
+                scalar_t proportion = part[i];
+                if (proportion < 0.f)
+                {
+                    const scalar_t e1 = row[i + cardinal[f]];
+                    const scalar_t e2 = row[i + diagonal[f]];
+                    const scalar_t s1 = (row[i] - e1) * inverse_d1[f];
+                    const scalar_t s2 = (e1 - e2) * inverse_d2[f];
+                    proportion = arctan(s2 / s1) / alpha[f];
+                }
+
+                facets[j * nx + i] = std::uint8_t(f);
+                proportions[j * nx + i] = proportion;
+            }
+        }
+
+        for (int k = 0; k < nx * ny; ++k)
+        {
+            const index_t c = order[k];
+            const int f = facets[c];
+            if (f == NO_FACET)
+                continue;
+
+            values[c + diagonal[f]] += values[c] * proportions[c];
+            values[c + cardinal[f]] += values[c] * (1.f - proportions[c]);
+        }
+    }
+} // namespace flow
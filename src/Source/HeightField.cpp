@@ -1,6 +1,9 @@
 #include "HeightField.h"
 
+#include "Decimation.h"
 #include "gkitext.h"
+#include "Parallel.h"
+#include "Stencil.h"
 #include "vecext.h"
 #include "Utils.h"
 
@@ -16,14 +19,17 @@ namespace mmv
 
     ScalarField::ScalarField(int dim) : Array2(dim)
     {
+        m_Diag = Diagonal();
     }
 
     ScalarField::ScalarField(int nx, int ny) : Array2(nx, ny)
     {
+        m_Diag = Diagonal();
     }
 
     ScalarField::ScalarField(const std::vector<scalar_t> &elevations, int nx, int ny) : Array2(elevations, nx, ny)
     {
+        m_Diag = Diagonal();
     }
 
     ScalarField::ScalarField(const std::vector<scalar_t> &elevations, const vec2 &a, const vec2 &b, int nx, int ny) : Array2(elevations, a, b, nx, ny)
@@ -46,6 +52,8 @@ namespace mmv
             m_Nx = nx;
         if (ny > 0)
             m_Ny = ny;
+
+        Touch();
     }
 
     Point ScalarField::Point3D(index_t i, index_t j) const
@@ -55,98 +63,109 @@ namespace mmv
 
     vec2 ScalarField::Gradient(index_t i, index_t j) const
     {
-        scalar_t grad_x = 0.f;
-        if (i == 0)
-            grad_x = (Height(i + 1, j) - Height(i, j)) * 0.5f;
-        else if (i == m_Nx - 1)
-            grad_x = (Height(i, j) - Height(i - 1, j)) * 0.5f;
-        else
-            grad_x = (Height(i + 1, j) - Height(i - 1, j)) * 0.5f;
+        UpdateGradients();
+        return {m_GradientsX.At(i, j), m_GradientsY.At(i, j)};
+    }
 
-        scalar_t grad_y = 0.f;
-        if (j == 0)
-            grad_y = (Height(i, j + 1) - Height(i, j)) * 0.5f;
-        else if (j == m_Ny - 1)
-            grad_y = (Height(i, j) - Height(i, j - 1)) * 0.5f;
-        else
-            grad_y = (Height(i, j + 1) - Height(i, j - 1)) * 0.5f;
+    vec2 ScalarField::Gradient(scalar_t x, scalar_t y) const
+    {
+        UpdateGradients();
+        return {Sample(m_GradientsX, x, y), Sample(m_GradientsY, x, y)};
+    }
 
-        return {grad_x, grad_y};
+    scalar_t ScalarField::Laplacian(index_t i, index_t j) const
+    {
+        UpdateLaplacians();
+        return m_Laplacians.At(i, j);
     }
 
-    vec2 ScalarField::Gradient(scalar_t x, scalar_t y) const
+    scalar_t ScalarField::Laplacian(scalar_t x, scalar_t y) const
     {
-        scalar_t grad_x = 0.f;
-        if (x < 1.f)
-            grad_x = (Height(x + 1, y) - Height(x, y)) * 0.5f;
-        else if (x > scalar_t(m_Nx - 2))
-            grad_x = (Height(x, y) - Height(x - 1, y)) * 0.5f;
-        else
-            grad_x = (Height(x + 1, y) - Height(x - 1, y)) * 0.5f;
+        UpdateLaplacians();
+        return Sample(m_Laplacians, x, y);
+    }
 
-        scalar_t grad_y = 0.f;
-        if (y < 1.f)
-            grad_y = (Height(x, y + 1) - Height(x, y)) * 0.5f;
-        else if (y > scalar_t(m_Ny - 2))
-            grad_y = (Height(x, y) - Height(x, y - 1)) * 0.5f;
-        else
-            grad_y = (Height(x, y + 1) - Height(x, y - 1)) * 0.5f;
+    const Array2<scalar_t> &ScalarField::GradientsX() const
+    {
+        UpdateGradients();
+        return m_GradientsX;
+    }
 
-        return {grad_x, grad_y};
+    const Array2<scalar_t> &ScalarField::GradientsY() const
+    {
+        UpdateGradients();
+        return m_GradientsY;
     }
 
-    scalar_t ScalarField::Laplacian(index_t i, index_t j) const
+    const Array2<scalar_t> &ScalarField::Laplacians() const
     {
-        scalar_t laplacian_x = 0.f;
-        if (i == 0)
-            laplacian_x = (Height(i + 2, j) - 2.f * Height(i + 1, j) + Height(i, j));
-        else if (i == m_Nx - 1)
-            laplacian_x = (Height(i, j) - 2.f * Height(i - 1, j) + Height(i - 2, j));
-        else
-            laplacian_x = (Height(i + 1, j) - 2.f * Height(i, j) + Height(i - 1, j));
+        UpdateLaplacians();
+        return m_Laplacians;
+    }
+
+    scalar_t ScalarField::Sample(const Array2 &layer, scalar_t x, scalar_t y) const
+    {
+        scalar_t fi = std::clamp((x - m_A.x) / m_Diag.x, 0.f, scalar_t(m_Nx - 1));
+        scalar_t fj = std::clamp((y - m_A.y) / m_Diag.y, 0.f, scalar_t(m_Ny - 1));
 
-        scalar_t laplacian_y = 0.f;
-        if (j == 0)
-            laplacian_y = (Height(i, j + 2) - 2.f * Height(i, j + 1) + Height(i, j));
-        else if (j == m_Ny - 1)
-            laplacian_y = (Height(i, j) - 2.f * Height(i, j - 1) + Height(i, j - 2));
-        else
-            laplacian_y = (Height(i, j + 1) - 2.f * Height(i, j) + Height(i, j - 1));
+        int i = std::min(int(fi), std::max(m_Nx - 2, 0));
+        int j = std::min(int(fj), std::max(m_Ny - 2, 0));
+        int i1 = std::min(i + 1, m_Nx - 1);
+        int j1 = std::min(j + 1, m_Ny - 1);
 
-        return laplacian_x + laplacian_y;
+        scalar_t u = fi - i;
+        scalar_t v = fj - j;
+
+        //! Bilinear Interpolation
+        return (1 - u) * (1 - v) * layer.At(i, j) + (1 - u) * v * layer.At(i, j1) + u * (1 - v) * layer.At(i1, j) + u * v * layer.At(i1, j1);
     }
 
-    scalar_t ScalarField::Laplacian(scalar_t x, scalar_t y) const
+    void ScalarField::UpdateGradients() const
     {
-        scalar_t laplacian_x = 0.f;
-        if (x < 1.f)
-            laplacian_x = (Height(x + 2, y) - 2.f * Height(x + 1, y) + Height(x, y));
-        else if (x > scalar_t(m_Nx - 2))
-            laplacian_x = (Height(x, y) - 2.f * Height(x - 1, y) + Height(x - 2, y));
-        else
-            laplacian_x = (Height(x + 1, y) - 2.f * Height(x, y) + Height(x - 1, y));
+        if (m_GradientsVersion == m_Version)
+            return;
 
-        scalar_t laplacian_y = 0.f;
-        if (y < 1.f)
-            laplacian_y = (Height(x, y + 2) - 2.f * Height(x, y + 1) + Height(x, y));
-        else if (y > scalar_t(m_Ny - 2))
-            laplacian_y = (Height(x, y) - 2.f * Height(x, y - 1) + Height(x, y - 2));
-        else
-            laplacian_y = (Height(x, y + 1) - 2.f * Height(x, y) + Height(x, y - 1));
+        m_GradientsX.Resize(m_Nx, m_Ny);
+        m_GradientsY.Resize(m_Nx, m_Ny);
 
-        return laplacian_x + laplacian_y;
+        stencil::gradient(m_Elements.data(), m_Nx, m_Ny, m_GradientsX.Data(), m_GradientsY.Data());
+
+        m_GradientsVersion = m_Version;
     }
 
-    int ScalarField::ExportElevation(const std::string &filename, int nx, int ny)
+    void ScalarField::UpdateLaplacians() const
+    {
+        if (m_LaplaciansVersion == m_Version)
+            return;
+
+        m_Laplacians.Resize(m_Nx, m_Ny);
+
+        stencil::laplacian(m_Elements.data(), m_Nx, m_Ny, m_Laplacians.Data());
+
+        m_LaplaciansVersion = m_Version;
+    }
+
+    //! Resize a caller-owned image, reusing its allocation when the dimensions don't change.
+    static void prepare_image(ImageData &image, int nx, int ny, int channels = 3)
+    {
+        if (image.width == nx && image.height == ny && image.channels == channels && image.size == 1)
+            return;
+
+        image.width = nx;
+        image.height = ny;
+        image.channels = channels;
+        image.size = 1;
+        image.pixels.assign(nx * ny * channels, 0);
+    }
+
+    void ScalarField::ElevationImage(ImageData &image, int nx, int ny)
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
         UpdateMinMax();
 
-        ImageData image(nx, ny, 3);
+        prepare_image(image, nx, ny);
 
         for (int j = 0; j < ny; ++j)
         {
@@ -154,31 +173,19 @@ namespace mmv
             for (int i = 0; i < nx; ++i)
             {
                 scalar_t u = (scalar_t)i / (scalar_t)nx * (scalar_t)m_Nx;
-                // scalar_t h = Height({u, v});
                 auto value = static_cast<pixel_t>(Normalize(u, v) * 255);
                 image.pixels[(j * nx + i) * 3 + 0] = value;
                 image.pixels[(j * nx + i) * 3 + 1] = value;
                 image.pixels[(j * nx + i) * 3 + 2] = value;
             }
         }
-
-        if (write_image_data(image, fullpath.c_str()) < 0)
-            return -1;
-
-#ifndef NDEBUG
-        utils::status("[Height] Image ", filename, " successfully saved in ./data/output");
-#endif
-
-        return 0;
     }
 
-    int ScalarField::ExportGradient(const std::string &filename, int nx, int ny)
+    void ScalarField::GradientImage(ImageData &image, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
         vec2 min{1000.f, 1000.f}, max{-1000.f, -1000.f};
         std::vector<vec2> grads;
         grads.reserve(nx * ny);
@@ -207,7 +214,8 @@ namespace mmv
             }
         }
 
-        ImageData image(nx, ny, 3);
+        prepare_image(image, nx, ny);
+
         for (int j = 0; j < ny; ++j)
         {
             for (int i = 0; i < nx; ++i)
@@ -217,23 +225,14 @@ namespace mmv
                 image.pixels[(j * nx + i) * 3 + 2] = 0;
             }
         }
-
-        if (write_image_data(image, fullpath.c_str()) < 0)
-            return -1;
-
-#ifndef NDEBUG
-        utils::status("[Gradient] Image ", filename, " successfully saved in ./data/output");
-#endif
-
-        return 0;
     }
 
-    int ScalarField::ExportLaplacian(const std::string &filename, int nx, int ny)
+    void ScalarField::LaplacianMap(Array2 &values, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        Array2 laplacians(nx, ny);
+        values.Resize(nx, ny);
         for (int j = 0; j < ny; ++j)
         {
             scalar_t v = (scalar_t)j / (scalar_t)ny * (scalar_t)m_Ny;
@@ -246,11 +245,61 @@ namespace mmv
                     laplacian = -std::sqrt(-laplacian);
                 else
                     laplacian = std::sqrt(laplacian);
-                laplacians(i, j) = laplacian;
+                values(i, j) = laplacian;
             }
         }
 
-        laplacians.UpdateMinMax();
+        values.UpdateMinMax();
+    }
+
+    void ScalarField::LaplacianImage(ImageData &image, int nx, int ny) const
+    {
+        Array2 laplacians;
+        LaplacianMap(laplacians, nx, ny);
+        GrayscaleImage(image, laplacians);
+    }
+
+    int ScalarField::ExportElevation(const std::string &filename, int nx, int ny)
+    {
+        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+
+        ImageData image;
+        ElevationImage(image, nx, ny);
+
+        if (write_image_data(image, fullpath.c_str()) < 0)
+            return -1;
+
+#ifndef NDEBUG
+        utils::status("[Height] Image ", filename, " successfully saved in ./data/output");
+#endif
+
+        return 0;
+    }
+
+    int ScalarField::ExportGradient(const std::string &filename, int nx, int ny)
+    {
+        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+
+        ImageData image;
+        GradientImage(image, nx, ny);
+
+        if (write_image_data(image, fullpath.c_str()) < 0)
+            return -1;
+
+#ifndef NDEBUG
+        utils::status("[Gradient] Image ", filename, " successfully saved in ./data/output");
+#endif
+
+        return 0;
+    }
+
+    int ScalarField::ExportLaplacian(const std::string &filename, int nx, int ny)
+    {
+        nx = nx < 0 ? m_Nx : nx;
+        ny = ny < 0 ? m_Ny : ny;
+
+        Array2 laplacians;
+        LaplacianMap(laplacians, nx, ny);
 
         ExportGrayscaleImage(filename, nx, ny, laplacians);
 
@@ -296,24 +345,33 @@ namespace mmv
         return 0;
     }
 
-    int ScalarField::ExportGrayscaleImage(const std::string &filename, const int nx, const int ny, const Array2 &values) const
+    void ScalarField::GrayscaleImage(ImageData &image, const Array2 &values) const
     {
-        utils::info(filename, " min: ", values.Min(), " max: ", values.Max());
+        const int nx = values.Nx();
+        const int ny = values.Ny();
 
-        ImageData image(nx, ny, 3);
+        prepare_image(image, nx, ny);
 
         for (int j = 0; j < ny; ++j)
         {
-            scalar_t v = (scalar_t)j / (scalar_t)ny * (scalar_t)m_Ny;
             for (int i = 0; i < nx; ++i)
             {
-                scalar_t u = (scalar_t)i / (scalar_t)nx * (scalar_t)m_Nx;
                 pixel_t value = static_cast<pixel_t>(values.Normalize(i, j) * 255.f);
                 image.pixels[(j * nx + i) * 3 + 0] = value;
                 image.pixels[(j * nx + i) * 3 + 1] = value;
                 image.pixels[(j * nx + i) * 3 + 2] = value;
             }
         }
+    }
+
+    int ScalarField::ExportGrayscaleImage(const std::string &filename, const int nx, const int ny, const Array2 &values) const
+    {
+        utils::info(filename, " min: ", values.Min(), " max: ", values.Max());
+
+        assert(values.Nx() == nx && values.Ny() == ny);
+
+        ImageData image;
+        GrayscaleImage(image, values);
 
         std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
         if (write_image_data(image, fullpath.c_str()) < 0)
@@ -380,42 +438,223 @@ namespace mmv
 
     Mesh HeightField::Polygonize(int n) const
     {
-        Mesh mesh(GL_TRIANGLES);
+        std::vector<vec3> positions(n * n);
+        std::vector<vec3> normals(n * n);
+        std::vector<vec2> texcoords(n * n);
+        std::vector<unsigned> indices;
 
-        scalar_t step = 1.f / scalar_t(n - 1);
-        for (int j = 0; j < n; ++j)
-        {
-            scalar_t v = j * step * m_Ny;
-            for (int i = 0; i < n; ++i)
-            {
-                scalar_t u = i * step * m_Nx;
+        PolygonizeRows(n, &positions[0].x, &normals[0].x, &texcoords[0].x);
+        GridIndices(n, indices);
 
-                mesh.normal(Normal(u, v));
-                mesh.texcoord({u / (scalar_t)m_Nx, v / (scalar_t)m_Ny});
-                mesh.vertex(u, Height(u, v), v);
+        return Mesh(GL_TRIANGLES, std::move(positions), std::move(texcoords), std::move(normals), {}, std::move(indices));
+    }
 
-                if (i > 0 && j > 0)
-                {
-                    int prev_i = i - 1;
-                    int prev_j = j - 1;
+    void HeightField::PolygonizeVertices(int n, std::vector<float> &positions, std::vector<float> &normals, std::vector<float> *texcoords) const
+    {
+        positions.resize(std::size_t(n) * n * 3);
+        normals.resize(std::size_t(n) * n * 3);
+        if (texcoords)
+            texcoords->resize(std::size_t(n) * n * 2);
+
+        PolygonizeRows(n, positions.data(), normals.data(), texcoords ? texcoords->data() : nullptr);
+    }
 
-                    mesh.triangle(prev_j * n + prev_i, j * n + prev_i, j * n + i);
-                    mesh.triangle(prev_j * n + prev_i, j * n + i, prev_j * n + i);
+    void HeightField::GridIndices(int n, std::vector<unsigned> &indices)
+    {
+        indices.resize(std::size_t(n - 1) * (n - 1) * 6);
+
+        parallel_for(1, n, [&](int first, int last) {
+            for (int j = first; j < last; ++j)
+            {
+                unsigned *quad = &indices[std::size_t(j - 1) * (n - 1) * 6];
+                for (int i = 1; i < n; ++i, quad += 6)
+                {
+                    const unsigned a = (j - 1) * n + (i - 1), b = j * n + (i - 1), c = j * n + i, d = (j - 1) * n + i;
+                    quad[0] = a;
+                    quad[1] = b;
+                    quad[2] = c;
+                    quad[3] = a;
+                    quad[4] = c;
+                    quad[5] = d;
                 }
             }
+        }, 0, 64);
+    }
+
+    Mesh HeightField::PolygonizeAdaptive(scalar_t max_error) const
+    {
+        std::vector<index_t> vertices;
+        std::vector<unsigned> indices;
+        AdaptiveHierarchy().Extract(max_error, vertices, indices);
+
+        std::vector<vec3> positions(vertices.size());
+        std::vector<vec3> normals(vertices.size());
+        std::vector<vec2> texcoords(vertices.size());
+        AdaptiveVertices(vertices, &positions[0].x, &normals[0].x, &texcoords[0].x);
+
+        return Mesh(GL_TRIANGLES, std::move(positions), std::move(texcoords), std::move(normals), {}, std::move(indices));
+    }
+
+    void HeightField::PolygonizeAdaptive(scalar_t max_error, std::vector<float> &positions, std::vector<float> &normals, std::vector<float> &texcoords,
+                                         std::vector<unsigned> &indices) const
+    {
+        std::vector<index_t> vertices;
+        AdaptiveHierarchy().Extract(max_error, vertices, indices);
+
+        positions.resize(vertices.size() * 3);
+        normals.resize(vertices.size() * 3);
+        texcoords.resize(vertices.size() * 2);
+        AdaptiveVertices(vertices, positions.data(), normals.data(), texcoords.data());
+    }
+
+    void HeightField::AdaptiveVertices(const std::vector<index_t> &vertices, float *positions, float *normals, float *texcoords) const
+    {
+        UpdateGradients();
+        const scalar_t *gx = m_GradientsX.Data();
+        const scalar_t *gy = m_GradientsY.Data();
+
+        //! Same vertices as Polygonize(Nx) on the grid points
+        const scalar_t sx = scalar_t(m_Nx) / scalar_t(m_Nx - 1);
+        const scalar_t sy = scalar_t(m_Ny) / scalar_t(m_Ny - 1);
+
+        parallel_for(0, int(vertices.size()), [&](int first, int last) {
+            for (int v = first; v < last; ++v)
+            {
+                const index_t k = vertices[v];
+                const scalar_t u = (k % m_Nx) * sx, w = (k / m_Nx) * sy;
+                const vec3 normal = vec3(normalize(Vector(-gx[k], 1.f, -gy[k])));
+
+                positions[3 * v] = u;
+                positions[3 * v + 1] = m_Elements[k];
+                positions[3 * v + 2] = w;
+                normals[3 * v] = normal.x;
+                normals[3 * v + 1] = normal.y;
+                normals[3 * v + 2] = normal.z;
+                texcoords[2 * v] = u / (scalar_t)m_Nx;
+                texcoords[2 * v + 1] = w / (scalar_t)m_Ny;
+            }
+        }, 0, 4096);
+    }
+
+    Mesh HeightField::PolygonizeDecimated(int n, std::size_t max_triangles, scalar_t max_error) const
+    {
+        std::vector<vec3> positions(std::size_t(n) * n);
+        std::vector<unsigned> indices;
+        {
+            std::vector<vec3> normals(positions.size());
+            PolygonizeRows(n, &positions[0].x, &normals[0].x, nullptr);
         }
+        GridIndices(n, indices);
+
+        decimate(positions, indices, max_triangles, max_error);
+
+        std::vector<vec3> normals(positions.size());
+        std::vector<vec2> texcoords(positions.size());
+        parallel_for(0, int(positions.size()), [&](int first, int last) {
+            for (int v = first; v < last; ++v)
+            {
+                const vec3 &p = positions[v];
+                normals[v] = vec3(Normal(p.x, p.z));
+                texcoords[v] = vec2(p.x / (scalar_t)m_Nx, p.z / (scalar_t)m_Ny);
+            }
+        }, 0, 4096);
 
-        return mesh;
+        return Mesh(GL_TRIANGLES, std::move(positions), std::move(texcoords), std::move(normals), {}, std::move(indices));
     }
 
-    int HeightField::ExportNormal(const std::string &filename, int nx, int ny) const
+    const RTIN &HeightField::AdaptiveHierarchy() const
+    {
+        if (m_AdaptiveVersion == m_Version)
+            return m_Adaptive;
+
+        m_Adaptive.Build(m_Elements.data(), m_Nx, m_Ny);
+
+        m_AdaptiveVersion = m_Version;
+        return m_Adaptive;
+    }
+
+    void HeightField::PolygonizeRows(int n, float *positions, float *normals, float *texcoords) const
+    {
+        UpdateGradients();
+        const scalar_t *gx = m_GradientsX.Data();
+        const scalar_t *gy = m_GradientsY.Data();
+
+        //! Height(x, y) reads 0 past the last row and column
+        auto height = [&](int i, int j) { return (i >= m_Nx || j >= m_Ny) ? 0.f : m_Elements[j * m_Nx + i]; };
+
+        //! Interpolation terms of a coordinate, for Height (unclamped) and Sample (clamped), shared by every row
+        struct Axis
+        {
+            scalar_t w;
+            int i;
+            scalar_t fw;
+            int fi, fi1;
+        };
+        auto axis = [](scalar_t x, scalar_t a, scalar_t d, int size) {
+            Axis t;
+            const scalar_t f = (x - a) / d;
+            t.i = int(f);
+            t.w = f - t.i;
+
+            const scalar_t c = std::clamp(f, 0.f, scalar_t(size - 1));
+            t.fi = std::min(int(c), std::max(size - 2, 0));
+            t.fi1 = std::min(t.fi + 1, size - 1);
+            t.fw = c - t.fi;
+            return t;
+        };
+
+        const scalar_t step = 1.f / scalar_t(n - 1);
+        std::vector<scalar_t> us(n);
+        std::vector<Axis> columns(n);
+        for (int i = 0; i < n; ++i)
+        {
+            us[i] = i * step * m_Nx;
+            columns[i] = axis(us[i], m_A.x, m_Diag.x, m_Nx);
+        }
+
+        parallel_for(0, n, [&](int first, int last) {
+            for (int j = first; j < last; ++j)
+            {
+                const scalar_t v = j * step * m_Ny;
+                const Axis row = axis(v, m_A.y, m_Diag.y, m_Ny);
+
+                for (int i = 0; i < n; ++i)
+                {
+                    const scalar_t u = us[i];
+                    const Axis &col = columns[i];
+                    const int k = j * n + i;
+
+                    const scalar_t h = (1 - col.w) * (1 - row.w) * height(col.i, row.i) + (1 - col.w) * row.w * height(col.i, row.i + 1) +
+                                       col.w * (1 - row.w) * height(col.i + 1, row.i) + col.w * row.w * height(col.i + 1, row.i + 1);
+
+                    auto sample = [&](const scalar_t *layer) {
+                        return (1 - col.fw) * (1 - row.fw) * layer[row.fi * m_Nx + col.fi] + (1 - col.fw) * row.fw * layer[row.fi1 * m_Nx + col.fi] +
+                               col.fw * (1 - row.fw) * layer[row.fi * m_Nx + col.fi1] + col.fw * row.fw * layer[row.fi1 * m_Nx + col.fi1];
+                    };
+
+                    const vec3 normal = vec3(normalize(Vector(-sample(gx), 1.f, -sample(gy))));
+                    positions[3 * k] = u;
+                    positions[3 * k + 1] = h;
+                    positions[3 * k + 2] = v;
+                    normals[3 * k] = normal.x;
+                    normals[3 * k + 1] = normal.y;
+                    normals[3 * k + 2] = normal.z;
+                    if (texcoords)
+                    {
+                        texcoords[2 * k] = u / (scalar_t)m_Nx;
+                        texcoords[2 * k + 1] = v / (scalar_t)m_Ny;
+                    }
+                }
+            }
+        }, 0, 16);
+    }
+
+    void HeightField::NormalImage(ImageData &image, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        ImageData image(nx, ny, 3);
+        prepare_image(image, nx, ny);
 
         for (int j = 0; j < ny; ++j)
         {
@@ -429,70 +668,68 @@ namespace mmv
                 image.pixels[(j * nx + i) * 3 + 2] = static_cast<pixel_t>(std::max(0.f, std::min(255.f, (normal.y + 0.5f) * 0.5f * 255.f)));
             }
         }
-
-        if (write_image_data(image, fullpath.c_str()) < 0)
-            return -1;
-
-#ifndef NDEBUG
-        utils::status("[Normal] Image ", filename, " successfully saved in ./data/output");
-#endif
-
-        return 0;
     }
 
-    int HeightField::ExportSlope(const std::string &filename, int nx, int ny) const
+    void HeightField::SlopeMap(Array2 &values, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        Array2 slope(nx, ny);
-
+        values.Resize(nx, ny);
         for (int j = 0; j < ny; ++j)
         {
             scalar_t v = (scalar_t)j / (scalar_t)ny * (scalar_t)m_Ny;
             for (int i = 0; i < nx; ++i)
             {
                 scalar_t u = (scalar_t)i / (scalar_t)nx * (scalar_t)m_Nx;
-                slope(i, j) = std::sqrt(Slope(u, v));
+                values(i, j) = std::sqrt(Slope(u, v));
             }
         }
 
-        slope.UpdateMinMax();
-
-        ExportGrayscaleImage(filename, nx, ny, slope);
+        values.UpdateMinMax();
+    }
 
-        return 0;
+    void HeightField::SlopeImage(ImageData &image, int nx, int ny) const
+    {
+        Array2 slope;
+        SlopeMap(slope, nx, ny);
+        GrayscaleImage(image, slope);
     }
 
-    int HeightField::ExportAverageSlope(const std::string &filename, int nx, int ny) const
+    void HeightField::AverageSlopeMap(Array2 &values, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        Array2 avgslope(nx, ny);
+        values.Resize(nx, ny);
         for (int j = 0; j < ny; ++j)
         {
             scalar_t v = (scalar_t)j / (scalar_t)ny * (scalar_t)m_Ny;
             for (int i = 0; i < nx; ++i)
             {
                 scalar_t u = (scalar_t)i / (scalar_t)nx * (scalar_t)m_Nx;
-                avgslope(i, j) = std::sqrt(AverageSlope(u, v));
+                values(i, j) = std::sqrt(AverageSlope(u, v));
             }
         }
 
-        avgslope.UpdateMinMax();
-
-        ExportGrayscaleImage(filename, nx, ny, avgslope);
+        values.UpdateMinMax();
+    }
 
-        return 0;
+    void HeightField::AverageSlopeImage(ImageData &image, int nx, int ny) const
+    {
+        Array2 avgslope;
+        AverageSlopeMap(avgslope, nx, ny);
+        GrayscaleImage(image, avgslope);
     }
 
-    int HeightField::ExportShading(const std::string &filename, const Vector &light_direction, int nx, int ny) const
+    void HeightField::ShadingMap(Array2 &values, const Vector &light_direction, int nx, int ny) const
     {
         nx = nx < 0 ? m_Nx : nx;
         ny = ny < 0 ? m_Ny : ny;
 
-        Array2 shades(nx, ny);
+        const Vector light = normalize(-light_direction);
+
+        values.Resize(nx, ny);
         for (int j = 0; j < ny; ++j)
         {
             scalar_t v = (scalar_t)j / (scalar_t)ny * (scalar_t)m_Ny;
@@ -500,11 +737,70 @@ namespace mmv
             {
                 scalar_t u = (scalar_t)i / (scalar_t)nx * (scalar_t)m_Nx;
                 Vector normal = Normal(u, v);
-                shades(i, j) = std::max(0.f, dot(normalize(-light_direction), normal));
+                values(i, j) = std::max(0.f, dot(light, normal));
             }
         }
 
-        shades.UpdateMinMax();
+        values.UpdateMinMax();
+    }
+
+    void HeightField::ShadingImage(ImageData &image, const Vector &light_direction, int nx, int ny) const
+    {
+        Array2 shades;
+        ShadingMap(shades, light_direction, nx, ny);
+        GrayscaleImage(image, shades);
+    }
+
+    int HeightField::ExportNormal(const std::string &filename, int nx, int ny) const
+    {
+        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+
+        ImageData image;
+        NormalImage(image, nx, ny);
+
+        if (write_image_data(image, fullpath.c_str()) < 0)
+            return -1;
+
+#ifndef NDEBUG
+        utils::status("[Normal] Image ", filename, " successfully saved in ./data/output");
+#endif
+
+        return 0;
+    }
+
+    int HeightField::ExportSlope(const std::string &filename, int nx, int ny) const
+    {
+        nx = nx < 0 ? m_Nx : nx;
+        ny = ny < 0 ? m_Ny : ny;
+
+        Array2 slope;
+        SlopeMap(slope, nx, ny);
+
+        ExportGrayscaleImage(filename, nx, ny, slope);
+
+        return 0;
+    }
+
+    int HeightField::ExportAverageSlope(const std::string &filename, int nx, int ny) const
+    {
+        nx = nx < 0 ? m_Nx : nx;
+        ny = ny < 0 ? m_Ny : ny;
+
+        Array2 avgslope;
+        AverageSlopeMap(avgslope, nx, ny);
+
+        ExportGrayscaleImage(filename, nx, ny, avgslope);
+
+        return 0;
+    }
+
+    int HeightField::ExportShading(const std::string &filename, const Vector &light_direction, int nx, int ny) const
+    {
+        nx = nx < 0 ? m_Nx : nx;
+        ny = ny < 0 ? m_Ny : ny;
+
+        Array2 shades;
+        ShadingMap(shades, light_direction, nx, ny);
 
         ExportGrayscaleImage(filename, nx, ny, shades);
 
@@ -553,9 +849,17 @@ namespace mmv
         return 0;
     }
 
-    int HeightField::ExportObj(const std::string &filename, int resolution)
+    int HeightField::ExportObj(const std::string &filename, int resolution, MeshMode mode, scalar_t max_error, std::size_t max_triangles) const
     {
-        return write_mesh(Polygonize(resolution), filename.c_str());
+        switch (mode)
+        {
+        case ADAPTIVE_MESH:
+            return write_mesh(PolygonizeAdaptive(max_error), filename.c_str());
+        case DECIMATED_MESH:
+            return write_mesh(PolygonizeDecimated(resolution, max_triangles, max_error), filename.c_str());
+        default:
+            return write_mesh(Polygonize(resolution), filename.c_str());
+        }
     }
 
     bool comp(scalar_t a, scalar_t b) { return a > b; }
@@ -565,33 +869,34 @@ namespace mmv
      * |v01|idx|v21|---|
      * |v02|v12|v22|---|
      */
-    int HeightField::ExportStreamArea(const std::string &filename) const
+    void HeightField::StreamAreaImage(ImageData &image, flow::Mode mode) const
     {
-        Array2 A = StreamArea();
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+        const Array2 &A = StreamAreas(mode);
 
-        ImageData image(m_Nx, m_Ny, 3);
+        //! Square rooted areas, normalized: the square root is monotonic, its bounds are those of the areas
+        const scalar_t lo = std::sqrt(A.Min());
+        const scalar_t range = std::sqrt(A.Max()) - lo;
 
-        for (int j = 0; j < A.Ny(); ++j)
-        {
-            for (int i = 0; i < A.Nx(); ++i)
-            {
-                A(i, j) = std::sqrt(A(i, j));
-            }
-        }
-
-        A.UpdateMinMax();
+        prepare_image(image, m_Nx, m_Ny);
 
         for (int j = 0; j < m_Ny; ++j)
         {
             for (int i = 0; i < m_Nx; ++i)
             {
-                pixel_t value = static_cast<pixel_t>(A.Normalize(i, j) * 128.f); 
+                pixel_t value = static_cast<pixel_t>((std::sqrt(A.At(i, j)) - lo) / range * 128.f);
                 image.pixels[(j * m_Nx + i) * 3 + 0] = std::min(99 + value, 255);
                 image.pixels[(j * m_Nx + i) * 3 + 1] = std::min(132 + value, 255);
                 image.pixels[(j * m_Nx + i) * 3 + 2] = std::min(235 + value, 255);
             }
         }
+    }
+
+    int HeightField::ExportStreamArea(const std::string &filename, flow::Mode mode) const
+    {
+        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+
+        ImageData image;
+        StreamAreaImage(image, mode);
 
         if (write_image_data(image, fullpath.c_str()) < 0)
             return -1;
@@ -602,55 +907,120 @@ namespace mmv
         return 0;
     }
 
-    Array2<scalar_t> HeightField::StreamArea() const
+    const flow::Routing &HeightField::FlowRouting(flow::Execution policy) const
     {
-        //! On trie les hauteurs dans l'ordre décroissant et on les stocke dans une queue
-        std::priority_queue<std::pair<scalar_t, int>> Q;
-        for (int i = 0; auto e : m_Elements)
-        {
-            Q.emplace(e, i);
-            i++;
-        }
+        if (m_RoutingVersion == m_Version)
+            return m_Routing;
 
-        Array2 A(m_Nx, m_Ny, 1.f);
-        while (!Q.empty())
-        {
-            auto [elv, idx] = Q.top();
-            Q.pop();
+        const vec2 cell = Diagonal();
+        flow::route(m_Elements.data(), m_Nx, m_Ny, cell.x, cell.y, m_Routing, policy);
 
-            int I = idx % m_Nx;
-            int J = (idx - I) / m_Nx;
+        m_RoutingVersion = m_Version;
+        return m_Routing;
+    }
 
-            vec2 grad = -Gradient(I, J);
-            scalar_t u = int(std::round(grad.x));
-            scalar_t v = int(std::round(grad.y));
+    const std::vector<index_t> &HeightField::ElevationOrder() const
+    {
+        if (m_ElevationOrderVersion == m_Version)
+            return m_ElevationOrder;
 
-            if (I + u >= 0 && I + u < m_Nx && J + v >= 0 && J + v < m_Ny)
-            {
-                scalar_t d = sqrt(abs(u) + abs(v));
-                if (d != 0.f)
-                    A(I + u, J + v) += A(I, J) / d;
-            }
+        flow::elevation_order(m_Elements.data(), m_Nx * m_Ny, m_ElevationOrder);
+
+        m_ElevationOrderVersion = m_Version;
+        return m_ElevationOrder;
+    }
+
+    Array2<scalar_t> HeightField::StreamArea(flow::Mode mode, flow::Execution policy) const
+    {
+        //! Every cell contributes its own area, passed downstream in topological order
+        Array2 A(m_Nx, m_Ny, 1.f);
+        const vec2 cell = Diagonal();
+
+        switch (mode)
+        {
+        case flow::Mode::D8:
+            flow::accumulate(FlowRouting(policy), A.Data(), policy);
+            break;
+        case flow::Mode::MFD:
+            flow::accumulate_mfd(m_Elements.data(), m_Nx, m_Ny, cell.x, cell.y, A.Data());
+            break;
+        case flow::Mode::DINF:
+            flow::accumulate_dinf(m_Elements.data(), m_Nx, m_Ny, cell.x, cell.y, ElevationOrder().data(), A.Data());
+            break;
         }
 
         A.UpdateMinMax();
-        utils::info("Stream Area min: ", A.Min(), " max: ", A.Max());
 
         return A;
     }
 
-    void HeightField::StreamPower()
+    const Array2<scalar_t> &HeightField::StreamAreas(flow::Mode mode) const
     {
-        const Array2 &A = StreamArea();
+        if (m_StreamAreasVersion == m_Version && m_StreamAreasMode == mode)
+            return m_StreamAreas;
 
-        scalar_t k = 1e-1;
-        for (int j = 0; j < m_Ny; ++j)
+        m_StreamAreas = StreamArea(mode);
+
+        m_StreamAreasVersion = m_Version;
+        m_StreamAreasMode = mode;
+        return m_StreamAreas;
+    }
+
+    void HeightField::StreamPower(scalar_t uplift, scalar_t k, scalar_t m, scalar_t n, scalar_t dt)
+    {
+        const flow::Routing &routing = FlowRouting();
+        const Array2 &A = StreamAreas();
+        const vec2 cell = Diagonal();
+
+        //! Receivers before donors: the elevation of the receiver is already the new one, so that
+        //! h = h0 - k * dt * A^m * ((h - h_r) / d)^n only has h as unknown
+        for (auto it = routing.order.rbegin(); it != routing.order.rend(); ++it)
         {
-            for (int i = 0; i < m_Nx; ++i)
+            const index_t c = *it;
+            const index_t r = routing.receivers[c];
+            const int i = c % m_Nx, j = c / m_Nx;
+
+            if (i == 0 || i == m_Nx - 1 || j == 0 || j == m_Ny - 1)
+                continue;
+
+            const scalar_t h0 = m_Elements[c] + uplift * dt;
+            if (r == c)
+            {
+                m_Elements[c] = h0;
+                continue;
+            }
+
+            const scalar_t hr = m_Elements[r];
+            const scalar_t u = (r % m_Nx - i) * cell.x, v = (r / m_Nx - j) * cell.y;
+            const scalar_t distance = std::sqrt(u * u + v * v);
+            const scalar_t f = k * dt * std::pow(A.At(c), m) / std::pow(distance, n);
+
+            if (n == 1.f)
             {
-                operator()(i, j) -= k * std::pow(A.At(i, j), 0.5) * Slope(i, j);
+                m_Elements[c] = (h0 + f * hr) / (1.f + f);
+                continue;
             }
+
+            //! Newton iterations on g(h) = h - h0 + f * (h - h_r)^n, never below the receiver. g is concave
+            //! for n < 1 and Newton overshoots the root: a step reaching the receiver halves the drop instead.
+            scalar_t h = h0;
+            for (int iteration = 0; iteration < 50 && h > hr; ++iteration)
+            {
+                const scalar_t drop = h - hr;
+                const scalar_t g = h - h0 + f * std::pow(drop, n);
+                const scalar_t dg = 1.f + n * f * std::pow(drop, n - 1.f);
+                const scalar_t step = g / dg;
+
+                const scalar_t next = h - step > hr ? h - step : hr + 0.5f * drop;
+                const bool converged = std::abs(next - h) <= 1e-6f * std::max(1.f, std::abs(h));
+                h = next;
+                if (converged)
+                    break;
+            }
+            m_Elements[c] = std::max(h, hr);
         }
+
+        Touch();
     }
 
     Vector HeightField::Normal(index_t i, index_t j) const
@@ -667,7 +1037,7 @@ namespace mmv
 
     scalar_t HeightField::Slope(index_t i, index_t j) const
     {
-        return length(Gradient(i, j));
+        return Slopes().At(i, j);
     }
 
     scalar_t HeightField::Slope(scalar_t x, scalar_t y) const
@@ -677,118 +1047,72 @@ namespace mmv
 
     scalar_t HeightField::AverageSlope(index_t i, index_t j) const
     {
-        assert(i >= 0.f && i <= m_Nx);
-        assert(j >= 0.f && j <= m_Ny);
-
-        int count = 1;
-        scalar_t sum_slope = Slope(i, j);
-        if (i - 1 >= 0 && j - 1 >= 0)
-        {
-            sum_slope += Slope(i - 1, j - 1);
-            count++;
-        }
-
-        if (i + 1 < m_Nx && j - 1 >= 0)
-        {
-            sum_slope += Slope(i + 1, j - 1);
-            count++;
-        }
-
-        if (i + 1 < m_Nx && j + 1 < m_Ny)
-        {
-            sum_slope += Slope(i + 1, j + 1);
-            count++;
-        }
-
-        if (i - 1 >= 0 && j + 1 < m_Ny)
-        {
-            sum_slope += Slope(i - 1, j + 1);
-            count++;
-        }
-
-        if (i - 1 >= 0)
-        {
-            sum_slope += Slope(i - 1, j);
-            count++;
-        }
-
-        if (i + 1 < (scalar_t)m_Nx)
-        {
-            sum_slope += Slope(i + 1, j);
-            count++;
-        }
-
-        if (j - 1 >= 0)
-        {
-            sum_slope += Slope(i, j - 1);
-            count++;
-        }
-
-        if (j + 1 < (scalar_t)m_Ny)
-        {
-            sum_slope += Slope(i, j + 1);
-            count++;
-        }
-
-        return sum_slope / (scalar_t)count;
+        assert(InBounds(i, j));
+        return AverageSlopes().At(i, j);
     }
 
     scalar_t HeightField::AverageSlope(scalar_t x, scalar_t y) const
     {
         assert(x >= 0.f && x <= (scalar_t)m_Nx);
         assert(y >= 0.f && y <= (scalar_t)m_Ny);
+        return Sample(AverageSlopes(), x, y);
+    }
 
-        int count = 1;
-        scalar_t sum_slope = Slope(x, y);
-        if (x - 1 >= 0 && y - 1 >= 0)
-        {
-            sum_slope += Slope(x - 1, y - 1);
-            count++;
-        }
+    const Array2<scalar_t> &HeightField::Slopes() const
+    {
+        if (m_SlopesVersion == m_Version)
+            return m_Slopes;
 
-        if (x + 1 < m_Nx && y - 1 >= 0)
-        {
-            sum_slope += Slope(x + 1, y - 1);
-            count++;
-        }
+        UpdateGradients();
 
-        if (x + 1 < m_Nx && y + 1 < m_Ny)
-        {
-            sum_slope += Slope(x + 1, y + 1);
-            count++;
-        }
+        m_Slopes.Resize(m_Nx, m_Ny);
+        stencil::slope(m_GradientsX.Data(), m_GradientsY.Data(), m_Nx * m_Ny, m_Slopes.Data());
 
-        if (x - 1 >= 0 && y + 1 < m_Ny)
-        {
-            sum_slope += Slope(x - 1, y + 1);
-            count++;
-        }
+        m_SlopesVersion = m_Version;
+        return m_Slopes;
+    }
 
-        if (x - 1 >= 0)
-        {
-            sum_slope += Slope(x - 1, y);
-            count++;
-        }
+    const Array2<scalar_t> &HeightField::AverageSlopes() const
+    {
+        if (m_AverageSlopesVersion == m_Version)
+            return m_AverageSlopes;
 
-        if (x + 1 < (scalar_t)m_Nx)
-        {
-            sum_slope += Slope(x + 1, y);
-            count++;
-        }
+        const Array2 &S = Slopes();
 
-        if (y - 1 >= 0)
+        //! Average the slopes over the 8-connexity neighbourhood that lies inside the grid
+        m_AverageSlopes.Resize(m_Nx, m_Ny);
+        for (int j = 0; j < m_Ny; ++j)
         {
-            sum_slope += Slope(x, y - 1);
-            count++;
-        }
+            for (int i = 0; i < m_Nx; ++i)
+            {
+                int count = 0;
+                scalar_t sum_slope = 0.f;
+                for (int pj = std::max(j - 1, 0); pj <= std::min(j + 1, m_Ny - 1); ++pj)
+                {
+                    for (int pi = std::max(i - 1, 0); pi <= std::min(i + 1, m_Nx - 1); ++pi)
+                    {
+                        sum_slope += S.At(pi, pj);
+                        count++;
+                    }
+                }
 
-        if (y + 1 < (scalar_t)m_Ny)
-        {
-            sum_slope += Slope(x, y + 1);
-            count++;
+                m_AverageSlopes(i, j) = sum_slope / (scalar_t)count;
+            }
         }
 
-        return sum_slope / (scalar_t)count;
+        m_AverageSlopesVersion = m_Version;
+        return m_AverageSlopes;
+    }
+
+    void HeightField::Normals(Array2 &x, Array2 &y, Array2 &z) const
+    {
+        UpdateGradients();
+
+        x.Resize(m_Nx, m_Ny);
+        y.Resize(m_Nx, m_Ny);
+        z.Resize(m_Nx, m_Ny);
+
+        stencil::normal(m_GradientsX.Data(), m_GradientsY.Data(), m_Nx * m_Ny, x.Data(), y.Data(), z.Data());
     }
 
     std::vector<scalar_t> load_elevation(const std::string &map)
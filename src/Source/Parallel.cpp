@@ -0,0 +1,112 @@
+#include "Parallel.h"
+
+ThreadPool::ThreadPool(int threads)
+{
+    if (threads <= 0)
+        threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    //! The calling thread is the last worker
+    for (int i = 0; i < threads - 1; ++i)
+        m_workers.emplace_back([this] { work(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread &worker : m_workers)
+        worker.join();
+}
+
+ThreadPool &ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+int ThreadPool::size() const
+{
+    return int(m_workers.size()) + 1;
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty())
+                return;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallel_for(int begin, int end, const std::function<void(int, int)> &body, int threads, int grain)
+{
+    if (end <= begin)
+        return;
+
+    threads = threads <= 0 ? size() : std::min(threads, size());
+    grain = std::max(1, grain);
+
+    //! A few chunks per thread to balance uneven rows, never smaller than the grain
+    const int n = end - begin;
+    const int chunk = std::max(grain, n / (threads * 4) + (n % (threads * 4) != 0));
+    const int chunks = (n + chunk - 1) / chunk;
+
+    if (threads == 1 || chunks == 1)
+    {
+        body(begin, end);
+        return;
+    }
+
+    struct Job
+    {
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto job = std::make_shared<Job>();
+
+    //! Chunks are claimed from a shared counter, helpers that arrive late simply find none left
+    auto run = [job, &body, begin, end, chunk, chunks]() {
+        int c;
+        while ((c = job->next.fetch_add(1)) < chunks)
+        {
+            body(begin + c * chunk, std::min(end, begin + (c + 1) * chunk));
+            if (job->done.fetch_add(1) + 1 == chunks)
+            {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->finished.notify_all();
+            }
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int i = 0; i < std::min(threads, chunks) - 1; ++i)
+            m_tasks.emplace(run);
+    }
+    m_condition.notify_all();
+
+    run();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&job, chunks] { return job->done.load() == chunks; });
+}
+
+void parallel_for(int begin, int end, const std::function<void(int, int)> &body, int threads, int grain)
+{
+    ThreadPool::instance().parallel_for(begin, end, body, threads, grain);
+}
@@ -0,0 +1,153 @@
+#include "RTIN.h"
+
+#include "Parallel.h"
+
+namespace
+{
+    const scalar_t INFINITE = std::numeric_limits<scalar_t>::infinity();
+} // namespace
+
+namespace mmv
+{
+    void RTIN::Build(const scalar_t *elevations, int nx, int ny)
+    {
+        m_Nx = nx;
+        m_Ny = ny;
+        m_Size = 1;
+        while (m_Size < std::max(nx, ny) - 1)
+            m_Size *= 2;
+
+        m_Errors.assign(std::size_t(nx) * ny, 0.f);
+        m_Remap.assign(std::size_t(nx) * ny, ~0u);
+
+        //! Heights past the grid are read clamped: the triangles reaching there are never kept,
+        //! the errors of their midpoints do not matter
+        auto height = [&](int x, int y) { return elevations[std::min(y, ny - 1) * nx + std::min(x, nx - 1)]; };
+        auto error = [&](int x, int y) { return (x < nx && y < ny) ? m_Errors[y * nx + x] : 0.f; };
+
+        //! The pair of triangles around a midpoint (x, y) covers [x - h, x + h]^2: when one of them crosses
+        //! the last row or column, the pair is split down to the leaves. A hypotenuse lying on that row or
+        //! column leaves one triangle on each side, the outer one is simply dropped.
+        auto crosses = [](int c, int h, int last) { return c - h < last && c + h > last; };
+
+        //! Bottom-up, one level of midpoints at a time. A midpoint splits the hypotenuse shared by two
+        //! triangles. Its error is its distance to the hypotenuse plus the largest error of the four
+        //! children midpoints, computed at the previous level: the surface of the children is within
+        //! that distance of the surface of the parents, so the sum bounds the error of the parents.
+        //! The largest child error alone (Martini) is no bound: the actual error reached 1.4 times the
+        //! tolerance on fractal terrains.
+        //! Midpoints are independent within a level, rows are split over the threads.
+        for (int h = 1; h < m_Size; h *= 2)
+        {
+            //! Hypotenuses along the axes, of length 2h: midpoints with x / h + y / h odd, children
+            //! are the centers of the four h * h squares around
+            parallel_for(0, (std::min(ny - 1, m_Size) / h) + 1, [&](int first, int last) {
+                for (int r = first; r < last; r++)
+                {
+                    const int y = r * h;
+                    for (int x = (r % 2 == 0) ? h : 0; x < nx; x += 2 * h)
+                    {
+                        const bool horizontal = (r % 2 == 0);
+                        const scalar_t a = horizontal ? height(x - h, y) : height(x, y - h);
+                        const scalar_t b = horizontal ? height(x + h, y) : height(x, y + h);
+                        scalar_t children = 0.f;
+                        if (h > 1)
+                        {
+                            const int q = h / 2;
+                            if (x >= q && y >= q)
+                                children = std::max(children, error(x - q, y - q));
+                            if (y >= q)
+                                children = std::max(children, error(x + q, y - q));
+                            if (x >= q)
+                                children = std::max(children, error(x - q, y + q));
+                            children = std::max(children, error(x + q, y + q));
+                        }
+                        const bool straddles = horizontal ? crosses(x, h, nx - 1) || (y != ny - 1 && crosses(y, h, ny - 1))
+                                                          : crosses(y, h, ny - 1) || (x != nx - 1 && crosses(x, h, nx - 1));
+                        m_Errors[y * nx + x] = straddles ? INFINITE : std::abs(height(x, y) - 0.5f * (a + b)) + children;
+                    }
+                }
+            });
+
+            //! Hypotenuses along the diagonals of the 2h * 2h squares: midpoints at their centers,
+            //! children are the midpoints of their sides. The diagonal joins the two corners with
+            //! x / 2h + y / 2h even.
+            const int s = 2 * h;
+            parallel_for(0, (std::min(ny - 1, m_Size) + h) / s, [&](int first, int last) {
+                for (int r = first; r < last; r++)
+                {
+                    const int y = r * s + h;
+                    for (int x = h; x < nx; x += s)
+                    {
+                        const int x0 = x - h, y0 = y - h;
+                        const bool main = ((x0 / s + y0 / s) % 2 == 0);
+                        const scalar_t a = main ? height(x0, y0) : height(x0 + s, y0);
+                        const scalar_t b = main ? height(x0 + s, y0 + s) : height(x0, y0 + s);
+                        const scalar_t children = std::max({error(x - h, y), error(x + h, y), error(x, y - h), error(x, y + h)});
+                        const bool straddles = crosses(x, h, nx - 1) || crosses(y, h, ny - 1);
+                        m_Errors[y * nx + x] = straddles ? INFINITE : std::abs(height(x, y) - 0.5f * (a + b)) + children;
+                    }
+                }
+            });
+        }
+    }
+
+    scalar_t RTIN::MaxError() const
+    {
+        const int c = m_Size / 2;
+        return (c < m_Nx && c < m_Ny) ? m_Errors[c * m_Nx + c] : std::numeric_limits<scalar_t>::max();
+    }
+
+    void RTIN::Extract(scalar_t max_error, std::vector<index_t> &vertices, std::vector<unsigned> &indices) const
+    {
+        vertices.clear();
+        indices.clear();
+        if (m_Size == 0)
+            return;
+
+        Refine(0, 0, m_Size, m_Size, m_Size, 0, max_error, vertices, indices);
+        Refine(m_Size, m_Size, 0, 0, 0, m_Size, max_error, vertices, indices);
+
+        //! Only the entries used are reset, the next extraction does not pay for the whole grid
+        for (index_t k : vertices)
+            m_Remap[k] = ~0u;
+    }
+
+    void RTIN::Refine(int ax, int ay, int bx, int by, int cx, int cy, scalar_t max_error, std::vector<index_t> &vertices,
+                      std::vector<unsigned> &indices) const
+    {
+        const int xmin = std::min({ax, bx, cx}), ymin = std::min({ay, by, cy});
+        if (xmin >= m_Nx - 1 && std::max({ax, bx, cx}) > m_Nx - 1)
+            return;
+        if (ymin >= m_Ny - 1 && std::max({ay, by, cy}) > m_Ny - 1)
+            return;
+
+        //! Both triangles around a hypotenuse read the same error, so they split together. A midpoint past
+        //! the last row or column belongs to a triangle crossing it.
+        const int mx = (ax + bx) / 2, my = (ay + by) / 2;
+        const bool leaf = std::abs(ax - cx) + std::abs(ay - cy) == 1;
+        const bool outside = mx > m_Nx - 1 || my > m_Ny - 1;
+
+        if (!leaf && (outside || m_Errors[my * m_Nx + mx] > max_error))
+        {
+            Refine(cx, cy, ax, ay, mx, my, max_error, vertices, indices);
+            Refine(bx, by, cx, cy, mx, my, max_error, vertices, indices);
+            return;
+        }
+
+        //! Leaves past the last row or column
+        if (std::max({ax, bx, cx}) > m_Nx - 1 || std::max({ay, by, cy}) > m_Ny - 1)
+            return;
+
+        for (const auto &[x, y] : {std::pair{ax, ay}, std::pair{bx, by}, std::pair{cx, cy}})
+        {
+            const index_t k = y * m_Nx + x;
+            if (m_Remap[k] == ~0u)
+            {
+                m_Remap[k] = unsigned(vertices.size());
+                vertices.push_back(k);
+            }
+            indices.push_back(m_Remap[k]);
+        }
+    }
+} // namespace mmv
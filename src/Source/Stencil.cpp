@@ -0,0 +1,204 @@
+#include "Stencil.h"
+
+#include "Simd.h"
+
+namespace
+{
+    using namespace simd;
+
+    //! Same convention as ScalarField::Height(i, j): cells past the grid read as 0. Before it too:
+    //! the shifted second differences of a 2 cell wide grid reach index -1.
+    inline scalar_t at(const scalar_t *h, int nx, int ny, int i, int j)
+    {
+        if (i < 0 || j < 0 || i >= nx || j >= ny)
+            return 0.f;
+        return h[j * nx + i];
+    }
+
+    //! out[i] = (a[i] - b[i]) * 0.5 for i in [begin, end)
+    inline void half_difference(const scalar_t *a, const scalar_t *b, scalar_t *out, int begin, int end)
+    {
+        const vfloat half = set1(0.5f);
+
+        int i = begin;
+        for (; i + W <= end; i += W)
+            store(out + i, mul(sub(load(a + i), load(b + i)), half));
+        for (; i < end; ++i)
+            out[i] = (a[i] - b[i]) * 0.5f;
+    }
+
+    //! out[i] = (a[i] - 2 * b[i]) + c[i] for i in [begin, end)
+    inline void second_difference(const scalar_t *a, const scalar_t *b, const scalar_t *c, scalar_t *out, int begin, int end)
+    {
+        const vfloat two = set1(2.f);
+
+        int i = begin;
+        for (; i + W <= end; i += W)
+            store(out + i, add(sub(load(a + i), mul(two, load(b + i))), load(c + i)));
+        for (; i < end; ++i)
+            out[i] = (a[i] - 2.f * b[i]) + c[i];
+    }
+
+    //! Reference path for grids too small to have an interior.
+    void gradient_generic(const scalar_t *h, int nx, int ny, scalar_t *gx, scalar_t *gy)
+    {
+        for (int j = 0; j < ny; ++j)
+        {
+            for (int i = 0; i < nx; ++i)
+            {
+                if (i == 0)
+                    gx[j * nx + i] = (at(h, nx, ny, i + 1, j) - at(h, nx, ny, i, j)) * 0.5f;
+                else if (i == nx - 1)
+                    gx[j * nx + i] = (at(h, nx, ny, i, j) - at(h, nx, ny, i - 1, j)) * 0.5f;
+                else
+                    gx[j * nx + i] = (at(h, nx, ny, i + 1, j) - at(h, nx, ny, i - 1, j)) * 0.5f;
+
+                if (j == 0)
+                    gy[j * nx + i] = (at(h, nx, ny, i, j + 1) - at(h, nx, ny, i, j)) * 0.5f;
+                else if (j == ny - 1)
+                    gy[j * nx + i] = (at(h, nx, ny, i, j) - at(h, nx, ny, i, j - 1)) * 0.5f;
+                else
+                    gy[j * nx + i] = (at(h, nx, ny, i, j + 1) - at(h, nx, ny, i, j - 1)) * 0.5f;
+            }
+        }
+    }
+
+    void laplacian_generic(const scalar_t *h, int nx, int ny, scalar_t *out)
+    {
+        for (int j = 0; j < ny; ++j)
+        {
+            for (int i = 0; i < nx; ++i)
+            {
+                scalar_t laplacian_x = 0.f;
+                if (i == 0)
+                    laplacian_x = (at(h, nx, ny, i + 2, j) - 2.f * at(h, nx, ny, i + 1, j) + at(h, nx, ny, i, j));
+                else if (i == nx - 1)
+                    laplacian_x = (at(h, nx, ny, i, j) - 2.f * at(h, nx, ny, i - 1, j) + at(h, nx, ny, i - 2, j));
+                else
+                    laplacian_x = (at(h, nx, ny, i + 1, j) - 2.f * at(h, nx, ny, i, j) + at(h, nx, ny, i - 1, j));
+
+                scalar_t laplacian_y = 0.f;
+                if (j == 0)
+                    laplacian_y = (at(h, nx, ny, i, j + 2) - 2.f * at(h, nx, ny, i, j + 1) + at(h, nx, ny, i, j));
+                else if (j == ny - 1)
+                    laplacian_y = (at(h, nx, ny, i, j) - 2.f * at(h, nx, ny, i, j - 1) + at(h, nx, ny, i, j - 2));
+                else
+                    laplacian_y = (at(h, nx, ny, i, j + 1) - 2.f * at(h, nx, ny, i, j) + at(h, nx, ny, i, j - 1));
+
+                out[j * nx + i] = laplacian_x + laplacian_y;
+            }
+        }
+    }
+} // namespace
+
+namespace stencil
+{
+    int simd_width()
+    {
+        return W;
+    }
+
+    void gradient(const scalar_t *h, int nx, int ny, scalar_t *gx, scalar_t *gy)
+    {
+        if (nx < 3 || ny < 3)
+            return gradient_generic(h, nx, ny, gx, gy);
+
+        for (int j = 0; j < ny; ++j)
+        {
+            const scalar_t *row = h + j * nx;
+            scalar_t *gx_row = gx + j * nx;
+            scalar_t *gy_row = gy + j * nx;
+
+            //! d/dx: interior columns, then the two peeled border columns
+            half_difference(row + 1, row - 1, gx_row, 1, nx - 1);
+            gx_row[0] = (row[1] - row[0]) * 0.5f;
+            gx_row[nx - 1] = (row[nx - 1] - row[nx - 2]) * 0.5f;
+
+            //! d/dy: the border rows only change which rows are read
+            const scalar_t *next = j == ny - 1 ? row : row + nx;
+            const scalar_t *prev = j == 0 ? row : row - nx;
+            half_difference(next, prev, gy_row, 0, nx);
+        }
+    }
+
+    void laplacian(const scalar_t *h, int nx, int ny, scalar_t *out)
+    {
+        if (nx < 3 || ny < 3)
+            return laplacian_generic(h, nx, ny, out);
+
+        for (int j = 0; j < ny; ++j)
+        {
+            const scalar_t *row = h + j * nx;
+            scalar_t *out_row = out + j * nx;
+
+            //! d2/dy2 first, shifted stencil on the first and last rows
+            const scalar_t *a = row + nx, *b = row, *c = row - nx;
+            if (j == 0)
+            {
+                a = row + 2 * nx;
+                b = row + nx;
+                c = row;
+            }
+            else if (j == ny - 1)
+            {
+                a = row;
+                b = row - nx;
+                c = row - 2 * nx;
+            }
+            second_difference(a, b, c, out_row, 0, nx);
+
+            //! d2/dx2 on the interior columns, accumulated on top of d2/dy2
+            const vfloat two = set1(2.f);
+
+            int i = 1;
+            for (; i + W <= nx - 1; i += W)
+            {
+                vfloat lx = add(sub(load(row + i + 1), mul(two, load(row + i))), load(row + i - 1));
+                store(out_row + i, add(lx, load(out_row + i)));
+            }
+            for (; i < nx - 1; ++i)
+                out_row[i] = ((row[i + 1] - 2.f * row[i]) + row[i - 1]) + out_row[i];
+
+            //! Peeled border columns
+            out_row[0] = ((row[2] - 2.f * row[1]) + row[0]) + out_row[0];
+            out_row[nx - 1] = ((row[nx - 1] - 2.f * row[nx - 2]) + row[nx - 3]) + out_row[nx - 1];
+        }
+    }
+
+    void slope(const scalar_t *gx, const scalar_t *gy, int n, scalar_t *out)
+    {
+        int i = 0;
+        for (; i + W <= n; i += W)
+        {
+            vfloat x = load(gx + i);
+            vfloat y = load(gy + i);
+            store(out + i, sqrt(add(mul(x, x), mul(y, y))));
+        }
+        for (; i < n; ++i)
+            out[i] = std::sqrt(gx[i] * gx[i] + gy[i] * gy[i]);
+    }
+
+    void normal(const scalar_t *gx, const scalar_t *gy, int n, scalar_t *nx, scalar_t *ny, scalar_t *nz)
+    {
+        const vfloat one = set1(1.f);
+        const vfloat zero = set1(0.f);
+
+        int i = 0;
+        for (; i + W <= n; i += W)
+        {
+            vfloat x = load(gx + i);
+            vfloat y = load(gy + i);
+            vfloat k = div(one, sqrt(add(add(mul(x, x), one), mul(y, y))));
+            store(nx + i, mul(sub(zero, x), k));
+            store(ny + i, k);
+            store(nz + i, mul(sub(zero, y), k));
+        }
+        for (; i < n; ++i)
+        {
+            scalar_t k = 1.f / std::sqrt(gx[i] * gx[i] + 1.f + gy[i] * gy[i]);
+            nx[i] = -gx[i] * k;
+            ny[i] = k;
+            nz[i] = -gy[i] * k;
+        }
+    }
+} // namespace stencil
@@ -0,0 +1,385 @@
+#include "TerrainLOD.h"
+
+#include "Buffer.h"
+#include "Parallel.h"
+
+namespace
+{
+    //! Chunks not drawn for that many frames lose their vertex buffers.
+    const int CHUNK_LIFETIME = 120;
+
+    //! Squared distance from p to the box [a, b].
+    inline float distance2(const Point &p, const Point &a, const Point &b)
+    {
+        const float x = std::max({a.x - p.x, 0.f, p.x - b.x});
+        const float y = std::max({a.y - p.y, 0.f, p.y - b.y});
+        const float z = std::max({a.z - p.z, 0.f, p.z - b.z});
+        return x * x + y * y + z * z;
+    }
+} // namespace
+
+namespace mmv
+{
+    TerrainLOD::TerrainLOD(int chunk_size) : m_ChunkSize(std::max(chunk_size, 2))
+    {
+    }
+
+    void TerrainLOD::Build(const HeightField &hf)
+    {
+        m_Nx = hf.Nx();
+        m_Ny = hf.Ny();
+
+        //! Enough levels for the root to cover the whole field
+        const int span = std::max(std::max(m_Nx, m_Ny) - 1, 1);
+        int levels = 1;
+        while (Extent(levels - 1) < span)
+            levels++;
+
+        m_Levels.resize(levels);
+        for (int l = 0; l < levels; l++)
+        {
+            Level &level = m_Levels[l];
+            level.nx = std::max((m_Nx - 1 + Extent(l) - 1) / Extent(l), 1);
+            level.ny = std::max((m_Ny - 1 + Extent(l) - 1) / Extent(l), 1);
+            level.error.assign(std::size_t(level.nx) * level.ny, 0.f);
+            level.zmin.resize(std::size_t(level.nx) * level.ny);
+            level.zmax.resize(std::size_t(level.nx) * level.ny);
+        }
+
+        //! Leaves: bounds of their cells, no error
+        {
+            Level &leaves = m_Levels[0];
+            parallel_for(0, leaves.ny, [&](int first, int last) {
+                for (int y = first; y < last; y++)
+                {
+                    for (int x = 0; x < leaves.nx; x++)
+                    {
+                        const int x0 = x * m_ChunkSize, x1 = std::min(x0 + m_ChunkSize, m_Nx - 1);
+                        const int y0 = y * m_ChunkSize, y1 = std::min(y0 + m_ChunkSize, m_Ny - 1);
+
+                        scalar_t zmin = std::numeric_limits<scalar_t>::max(), zmax = std::numeric_limits<scalar_t>::lowest();
+                        for (int j = y0; j <= y1; j++)
+                        {
+                            for (int i = x0; i <= x1; i++)
+                            {
+                                zmin = std::min(zmin, hf.At(i, j));
+                                zmax = std::max(zmax, hf.At(i, j));
+                            }
+                        }
+                        leaves.zmin[y * leaves.nx + x] = zmin;
+                        leaves.zmax[y * leaves.nx + x] = zmax;
+                    }
+                }
+            });
+        }
+
+        //! Inner nodes: union of the bounds of their children, and their largest error plus the distance between
+        //! the vertices of the children and the triangles of the node (same diagonal as ChunkIndices)
+        for (int l = 1; l < levels; l++)
+        {
+            Level &level = m_Levels[l];
+            const Level &children = m_Levels[l - 1];
+            const int half = Stride(l - 1);
+
+            parallel_for(0, level.ny, [&](int first, int last) {
+                for (int y = first; y < last; y++)
+                {
+                    for (int x = 0; x < level.nx; x++)
+                    {
+                        scalar_t zmin = std::numeric_limits<scalar_t>::max(), zmax = std::numeric_limits<scalar_t>::lowest();
+                        scalar_t error = 0.f;
+                        for (int c = 0; c < 4; c++)
+                        {
+                            const int cx = 2 * x + (c & 1), cy = 2 * y + (c >> 1);
+                            if (cx >= children.nx || cy >= children.ny)
+                                continue;
+
+                            const int k = cy * children.nx + cx;
+                            zmin = std::min(zmin, children.zmin[k]);
+                            zmax = std::max(zmax, children.zmax[k]);
+                            error = std::max(error, children.error[k]);
+                        }
+
+                        const int x0 = x * Extent(l), y0 = y * Extent(l);
+                        auto sample = [&](int a, int b) { return hf.At(std::min(x0 + a * half, m_Nx - 1), std::min(y0 + b * half, m_Ny - 1)); };
+
+                        scalar_t deviation = 0.f;
+                        for (int b = 0; b <= 2 * m_ChunkSize && y0 + (b - 1) * half < m_Ny - 1; b++)
+                        {
+                            for (int a = 0; a <= 2 * m_ChunkSize && x0 + (a - 1) * half < m_Nx - 1; a++)
+                            {
+                                scalar_t approximation;
+                                if (a % 2 == 1 && b % 2 == 1)
+                                    approximation = 0.5f * (sample(a - 1, b - 1) + sample(a + 1, b + 1));
+                                else if (a % 2 == 1)
+                                    approximation = 0.5f * (sample(a - 1, b) + sample(a + 1, b));
+                                else if (b % 2 == 1)
+                                    approximation = 0.5f * (sample(a, b - 1) + sample(a, b + 1));
+                                else
+                                    continue;
+
+                                deviation = std::max(deviation, std::abs(sample(a, b) - approximation));
+                            }
+                        }
+
+                        level.zmin[y * level.nx + x] = zmin;
+                        level.zmax[y * level.nx + x] = zmax;
+                        level.error[y * level.nx + x] = error + deviation;
+                    }
+                }
+            });
+        }
+
+        const Level &root = m_Levels.back();
+        const scalar_t range = *std::max_element(root.zmax.begin(), root.zmax.end()) - *std::min_element(root.zmin.begin(), root.zmin.end());
+        m_SkirtDepth = std::max(2.f * *std::max_element(root.error.begin(), root.error.end()), 1e-3f * range);
+
+        //! The cached chunks are rewritten the next time they are drawn
+        m_Version++;
+    }
+
+    scalar_t TerrainLOD::Error(const Node &node) const
+    {
+        const Level &level = m_Levels[node.level];
+        return level.error[node.y * level.nx + node.x];
+    }
+
+    const std::vector<TerrainLOD::Node> &TerrainLOD::Select(const Transform &model, const Transform &view, const Transform &projection,
+                                                           float viewport_height, float fov, float max_pixel_error)
+    {
+        //! One selection per frame, whereas a frame may draw it several times (faces, edges, points)
+        m_Frame++;
+
+        //! Forget the chunks not drawn for a while
+        for (auto it = m_Chunks.begin(); it != m_Chunks.end();)
+        {
+            if (m_Frame - it->second.frame > CHUNK_LIFETIME)
+            {
+                glDeleteBuffers(3, it->second.buffers);
+                glDeleteVertexArrays(1, &it->second.vao);
+                it = m_Chunks.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        m_Selection.clear();
+        if (m_Levels.empty())
+            return m_Selection;
+
+        //! Frustum planes in model space (Gribb & Hartmann), a point is inside when a.x + b.y + c.z + d >= 0 for all of them
+        const Transform mvp = projection * view * model;
+        for (int p = 0; p < 6; p++)
+        {
+            const int row = p / 2;
+            const float sign = (p % 2 == 0) ? 1.f : -1.f;
+            for (int c = 0; c < 4; c++)
+                m_Planes[p][c] = mvp.m[3][c] + sign * mvp.m[row][c];
+        }
+
+        //! Screen-space error = error * pixels per unit at distance 1 / distance, in world space
+        m_Eye = Inverse(view)(Point(0.f, 0.f, 0.f));
+        m_Scale = vec3(length(model(Vector(1.f, 0.f, 0.f))), length(model(Vector(0.f, 1.f, 0.f))), length(model(Vector(0.f, 0.f, 1.f))));
+        m_PixelsPerError = viewport_height / (2.f * std::tan(radians(fov) / 2.f));
+        m_MaxPixelError = max_pixel_error;
+
+        const int root = int(m_Levels.size()) - 1;
+        for (int y = 0; y < m_Levels[root].ny; y++)
+            for (int x = 0; x < m_Levels[root].nx; x++)
+                Refine({root, x, y});
+
+        return m_Selection;
+    }
+
+    void TerrainLOD::Refine(const Node &node)
+    {
+        const Level &level = m_Levels[node.level];
+        const int k = node.y * level.nx + node.x;
+
+        //! Bounds in model space, positions follow Polygonize: x = i * nx / (nx - 1)
+        const float sx = float(m_Nx) / float(std::max(m_Nx - 1, 1));
+        const float sy = float(m_Ny) / float(std::max(m_Ny - 1, 1));
+        const Point a(node.x * Extent(node.level) * sx, level.zmin[k], node.y * Extent(node.level) * sy);
+        const Point b(std::min((node.x + 1) * Extent(node.level), m_Nx - 1) * sx, level.zmax[k], std::min((node.y + 1) * Extent(node.level), m_Ny - 1) * sy);
+
+        //! Frustum culling: the box is outside when its farthest corner along a plane normal is outside
+        for (const auto &plane : m_Planes)
+        {
+            const float x = plane[0] >= 0.f ? b.x : a.x;
+            const float y = plane[1] >= 0.f ? b.y : a.y - m_SkirtDepth;
+            const float z = plane[2] >= 0.f ? b.z : a.z;
+            if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0.f)
+                return;
+        }
+
+        if (node.level > 0)
+        {
+            const Point wa(a.x * m_Scale.x, a.y * m_Scale.y, a.z * m_Scale.z);
+            const Point wb(b.x * m_Scale.x, b.y * m_Scale.y, b.z * m_Scale.z);
+            const float distance = std::max(std::sqrt(distance2(m_Eye, wa, wb)), 1e-4f);
+
+            if (level.error[k] * m_Scale.y * m_PixelsPerError / distance > m_MaxPixelError)
+            {
+                const Level &children = m_Levels[node.level - 1];
+                for (int c = 0; c < 4; c++)
+                {
+                    const int cx = 2 * node.x + (c & 1), cy = 2 * node.y + (c >> 1);
+                    if (cx < children.nx && cy < children.ny)
+                        Refine({node.level - 1, cx, cy});
+                }
+                return;
+            }
+        }
+
+        m_Selection.push_back(node);
+    }
+
+    void TerrainLOD::ChunkVertices(const HeightField &hf, const Node &node, std::vector<float> &positions, std::vector<float> &normals,
+                                   std::vector<float> &texcoords) const
+    {
+        const int n = m_ChunkSize + 1;
+        const int count = n * n + 4 * n;
+        positions.resize(std::size_t(count) * 3);
+        normals.resize(std::size_t(count) * 3);
+        texcoords.resize(std::size_t(count) * 2);
+
+        const float sx = float(m_Nx) / float(std::max(m_Nx - 1, 1));
+        const float sy = float(m_Ny) / float(std::max(m_Ny - 1, 1));
+        const int stride = Stride(node.level);
+        const int x0 = node.x * Extent(node.level), y0 = node.y * Extent(node.level);
+
+        auto vertex = [&](int k, int a, int b, float drop) {
+            const int i = std::min(x0 + a * stride, m_Nx - 1), j = std::min(y0 + b * stride, m_Ny - 1);
+            const Vector normal = hf.Normal(i, j);
+
+            positions[3 * k] = i * sx;
+            positions[3 * k + 1] = hf.At(i, j) - drop;
+            positions[3 * k + 2] = j * sy;
+            normals[3 * k] = normal.x;
+            normals[3 * k + 1] = normal.y;
+            normals[3 * k + 2] = normal.z;
+            texcoords[2 * k] = i * sx / float(m_Nx);
+            texcoords[2 * k + 1] = j * sy / float(m_Ny);
+        };
+
+        for (int b = 0; b < n; b++)
+            for (int a = 0; a < n; a++)
+                vertex(b * n + a, a, b, 0.f);
+
+        //! Skirt: the four borders again, m_SkirtDepth lower
+        for (int t = 0; t < n; t++)
+        {
+            vertex(n * n + t, t, 0, m_SkirtDepth);
+            vertex(n * n + n + t, m_ChunkSize, t, m_SkirtDepth);
+            vertex(n * n + 2 * n + t, t, m_ChunkSize, m_SkirtDepth);
+            vertex(n * n + 3 * n + t, 0, t, m_SkirtDepth);
+        }
+    }
+
+    void TerrainLOD::ChunkIndices(std::vector<unsigned> &indices) const
+    {
+        const int n = m_ChunkSize + 1;
+        indices.clear();
+        indices.reserve(std::size_t(m_ChunkSize) * m_ChunkSize * 6 + std::size_t(4) * m_ChunkSize * 6);
+
+        //! Same triangles as Polygonize
+        for (int j = 1; j < n; j++)
+        {
+            for (int i = 1; i < n; i++)
+            {
+                const unsigned a = (j - 1) * n + (i - 1), b = j * n + (i - 1), c = j * n + i, d = (j - 1) * n + i;
+                indices.insert(indices.end(), {a, b, c, a, c, d});
+            }
+        }
+
+        //! Skirt quads between every border edge and its copy
+        auto border = [&](int side, int t) -> unsigned {
+            switch (side)
+            {
+            case 0:
+                return t;
+            case 1:
+                return t * n + m_ChunkSize;
+            case 2:
+                return m_ChunkSize * n + t;
+            default:
+                return t * n;
+            }
+        };
+        for (int side = 0; side < 4; side++)
+        {
+            for (int t = 0; t < m_ChunkSize; t++)
+            {
+                const unsigned a = border(side, t), b = border(side, t + 1);
+                const unsigned sa = n * n + side * n + t, sb = sa + 1;
+                indices.insert(indices.end(), {a, b, sb, a, sb, sa});
+            }
+        }
+    }
+
+    void TerrainLOD::Draw(const HeightField &hf, GLenum primitives)
+    {
+        if (m_IndexBuffer == 0)
+        {
+            std::vector<unsigned> indices;
+            ChunkIndices(indices);
+
+            glGenBuffers(1, &m_IndexBuffer);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_IndexBuffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned) * indices.size(), indices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            m_IndexCount = int(indices.size());
+        }
+
+        const int vertices = (m_ChunkSize + 1) * (m_ChunkSize + 1);
+        for (const Node &node : m_Selection)
+        {
+            Chunk &chunk = m_Chunks[Key(node)];
+            if (chunk.vao == 0)
+            {
+                ChunkVertices(hf, node, m_Positions, m_Normals, m_Texcoords);
+
+                glGenVertexArrays(1, &chunk.vao);
+                glGenBuffers(3, chunk.buffers);
+                glBindVertexArray(chunk.vao);
+                load_buffer(chunk.buffers[0], 0, 3, m_Positions, GL_DYNAMIC_DRAW);
+                load_buffer(chunk.buffers[1], 1, 2, m_Texcoords);
+                load_buffer(chunk.buffers[2], 2, 3, m_Normals, GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_IndexBuffer);
+                chunk.version = m_Version;
+            }
+            else if (chunk.version != m_Version)
+            {
+                //! The height field changed: same layout, rewrite the positions and the normals in place
+                ChunkVertices(hf, node, m_Positions, m_Normals, m_Texcoords);
+                update_buffer(chunk.buffers[0], m_Positions);
+                update_buffer(chunk.buffers[2], m_Normals);
+                chunk.version = m_Version;
+            }
+            chunk.frame = m_Frame;
+
+            glBindVertexArray(chunk.vao);
+            if (primitives == GL_POINTS)
+                glDrawArrays(GL_POINTS, 0, vertices);
+            else
+                glDrawElements(primitives, m_IndexCount, GL_UNSIGNED_INT, nullptr);
+        }
+        glBindVertexArray(0);
+    }
+
+    void TerrainLOD::Release()
+    {
+        for (auto &[key, chunk] : m_Chunks)
+        {
+            glDeleteBuffers(3, chunk.buffers);
+            glDeleteVertexArrays(1, &chunk.vao);
+        }
+        m_Chunks.clear();
+
+        if (m_IndexBuffer != 0)
+            glDeleteBuffers(1, &m_IndexBuffer);
+        m_IndexBuffer = 0;
+    }
+} // namespace mmv
@@ -17,9 +17,11 @@ int Viewer::init_any()
 
     init_shaders();
 
-    init_demo_scalar_field();
-
     glGenVertexArrays(VAO_TYPE::NB_VAO, m_vao);
+    glGenBuffers(VBO_TYPE::NB_VBO, m_buffers);
+    glGenBuffers(1, &m_index_buffer);
+
+    init_demo_scalar_field();
 
     m_tex_skybox = read_cubemap(0, std::string(DATA_DIR) + "/skybox7.png", GL_RGBA);
 
@@ -77,33 +79,16 @@ int Viewer::init_shaders()
 int Viewer::init_demo_scalar_field()
 {
     //! Generate height map using Perlin noise
-    m_elevations = znoise::generate_hmf("elevation.png", m_scale, m_hf_dim, m_hf_dim, m_hurst, m_lacunarity, m_base_scale, m_seed);
+    generate_elevations();
     m_hf_a = {0.f, 0.f};
     m_hf_b = {(float)m_hf_dim, (float)m_hf_dim};
 
     m_hf = mmv::HF::Create(m_elevations, m_hf_a, m_hf_b, m_hf_dim, m_hf_dim);
 
-    m_height_map = m_hf->Polygonize(m_resolution);
-    m_height_map.bounds(pmin, pmax);
+    update_height_field();
+    update_bounds();
     m_cs.orbiter().lookat(pmin, pmax);
 
-    m_hf->ExportGradient("gradient.png", m_output_dim, m_output_dim);
-    m_hf->ExportLaplacian("laplacian.png", m_output_dim, m_output_dim);
-    m_hf->ExportNormal("normal.png", m_output_dim, m_output_dim);
-    m_hf->ExportSlope("slope.png", m_output_dim, m_output_dim);
-    m_hf->ExportAverageSlope("avgslope.png", m_output_dim, m_output_dim);
-    m_hf->ExportShading("shading.png", m_shading_dir, m_output_dim, m_output_dim);
-    // m_hf->ExportStreamArea("streamarea.png");
-
-    m_tex_elevation = read_texture(0, std::string(DATA_DIR) + "/output/elevation.png");
-    m_tex_gradient = read_texture(0, std::string(DATA_DIR) + "/output/gradient.png");
-    m_tex_laplacian = read_texture(0, std::string(DATA_DIR) + "/output/laplacian.png");
-    m_tex_normal = read_texture(0, std::string(DATA_DIR) + "/output/normal.png");
-    m_tex_slope = read_texture(0, std::string(DATA_DIR) + "/output/slope.png");
-    m_tex_avg_slope = read_texture(0, std::string(DATA_DIR) + "/output/avgslope.png");
-    m_tex_shading = read_texture(0, std::string(DATA_DIR) + "/output/shading.png");
-    m_tex_stream_area = read_texture(0, std::string(DATA_DIR) + "/output/streamarea.png");
-
     save_params();
 
     return 0;
@@ -138,7 +123,9 @@ int Viewer::render()
 
 int Viewer::quit_any()
 {
-    m_height_map.release();
+    glDeleteBuffers(VBO_TYPE::NB_VBO, m_buffers);
+    glDeleteBuffers(1, &m_index_buffer);
+    m_terrain.Release();
 
     release_program(m_program_edges);
     release_program(m_program_points);
@@ -190,6 +177,9 @@ int Viewer::render_any()
     DrawParam param;
     param.model(model).view(view).projection(projection);
 
+    if (m_lod)
+        m_terrain.Select(model, view, projection, float(m_framebuffer_height), m_cs.fov(), m_lod_pixel_error);
+
     if (m_show_faces)
     {
         if (m_overlay != OVERLAY_TEX::NONE_TEX)
@@ -228,7 +218,7 @@ int Viewer::render_any()
                 break;
             }
 
-            m_height_map.draw(m_program_texture, true, true, true, false, false);
+            draw_height_map(GL_TRIANGLES);
         }
         else
         {
@@ -237,7 +227,7 @@ int Viewer::render_any()
             program_uniform(m_program_faces, "u_MvMatrix", mv);
             program_uniform(m_program_faces, "u_NormalMatrix", normalMatrix);
             program_uniform(m_program_faces, "u_Light", view(light));
-            m_height_map.draw(m_program_faces, true, false, true, false, false);
+            draw_height_map(GL_TRIANGLES);
         }
     }
 
@@ -250,7 +240,7 @@ int Viewer::render_any()
         GLint location = glGetUniformLocation(m_program_edges, "u_EdgeColor");
         glUniform4fv(location, 1, &m_color_edge[0]);
 
-        m_height_map.draw(m_program_edges, true, false, false, false, false);
+        draw_height_map(GL_TRIANGLES);
     }
 
     if (m_show_points)
@@ -262,7 +252,7 @@ int Viewer::render_any()
         GLint location = glGetUniformLocation(m_program_points, "u_PointColor");
         glUniform4fv(location, 1, &m_color_point[0]);
 
-        glDrawArrays(GL_POINTS, 0, m_height_map.vertex_count());
+        draw_height_map(GL_POINTS);
     }
 
     //! Render skybox
@@ -288,28 +278,156 @@ int Viewer::render_any()
     return 0;
 }
 
-int Viewer::update_height_field(bool export_elevation)
+int Viewer::update_height_field()
 {
-    m_height_map = m_hf->Polygonize(m_resolution);
+    //! The adaptive mesh changes with every edit, everything is uploaded again
+    if (m_adaptive)
+    {
+        std::vector<unsigned> indices;
+        m_hf->PolygonizeAdaptive(m_adaptive_error, m_positions, m_normals, m_texcoords, indices);
+
+        glBindVertexArray(m_vao[VAO_TYPE::OBJECT]);
+        load_buffer(m_buffers[VBO_TYPE::POSITION], 0, 3, m_positions, GL_DYNAMIC_DRAW);
+        load_buffer(m_buffers[VBO_TYPE::TEXCOORD], 1, 2, m_texcoords, GL_DYNAMIC_DRAW);
+        load_buffer(m_buffers[VBO_TYPE::NORMAL], 2, 3, m_normals, GL_DYNAMIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned) * indices.size(), indices.data(), GL_DYNAMIC_DRAW);
+        glBindVertexArray(0);
+
+        m_index_count = int(indices.size());
+        m_index_resolution = 0;
+    }
+    //! The indices and the texcoords only depend on the resolution: they are uploaded when it changes,
+    //! an edit of the terrain only rewrites the positions and the normals in place
+    else if (m_index_resolution != m_resolution)
+    {
+        m_hf->PolygonizeVertices(m_resolution, m_positions, m_normals, &m_texcoords);
+
+        std::vector<unsigned> indices;
+        mmv::HF::GridIndices(m_resolution, indices);
+
+        glBindVertexArray(m_vao[VAO_TYPE::OBJECT]);
+        load_buffer(m_buffers[VBO_TYPE::POSITION], 0, 3, m_positions, GL_DYNAMIC_DRAW);
+        load_buffer(m_buffers[VBO_TYPE::TEXCOORD], 1, 2, m_texcoords);
+        load_buffer(m_buffers[VBO_TYPE::NORMAL], 2, 3, m_normals, GL_DYNAMIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned) * indices.size(), indices.data(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+
+        m_index_count = int(indices.size());
+        m_index_resolution = m_resolution;
+    }
+    else
+    {
+        m_hf->PolygonizeVertices(m_resolution, m_positions, m_normals);
+
+        update_buffer(m_buffers[VBO_TYPE::POSITION], m_positions);
+        update_buffer(m_buffers[VBO_TYPE::NORMAL], m_normals);
+    }
+
+    if (m_lod)
+        m_terrain.Build(*m_hf);
+
+    update_overlays();
+
+    return 0;
+}
+
+int Viewer::update_bounds()
+{
+    pmin = Point(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    pmax = Point(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest());
+    for (std::size_t k = 0; k < m_positions.size(); k += 3)
+    {
+        const Point p(m_positions[k], m_positions[k + 1], m_positions[k + 2]);
+        pmin = min(pmin, p);
+        pmax = max(pmax, p);
+    }
+
+    return 0;
+}
+
+int Viewer::draw_height_map(GLenum primitives)
+{
+    if (m_lod)
+    {
+        m_terrain.Draw(*m_hf, primitives);
+        return 0;
+    }
 
-    if (export_elevation)
-        m_hf->ExportElevation("elevation.png", m_output_dim, m_output_dim);
+    glBindVertexArray(m_vao[VAO_TYPE::OBJECT]);
+    if (primitives == GL_POINTS)
+        glDrawArrays(GL_POINTS, 0, GLsizei(m_positions.size() / 3));
+    else
+        glDrawElements(primitives, m_index_count, GL_UNSIGNED_INT, nullptr);
+    glBindVertexArray(0);
+
+    return 0;
+}
+
+int Viewer::update_overlays()
+{
+    m_hf->ElevationImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_elevation = update_texture(m_tex_elevation, 0, m_overlay_image);
+
+    m_hf->GradientImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_gradient = update_texture(m_tex_gradient, 0, m_overlay_image);
+
+    m_hf->LaplacianImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_laplacian = update_texture(m_tex_laplacian, 0, m_overlay_image);
+
+    m_hf->NormalImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_normal = update_texture(m_tex_normal, 0, m_overlay_image);
+
+    m_hf->SlopeImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_slope = update_texture(m_tex_slope, 0, m_overlay_image);
+
+    m_hf->AverageSlopeImage(m_overlay_image, m_output_dim, m_output_dim);
+    m_tex_avg_slope = update_texture(m_tex_avg_slope, 0, m_overlay_image);
+
+    update_stream_area();
+    update_shading();
+
+    return 0;
+}
+
+int Viewer::update_stream_area()
+{
+    m_hf->StreamAreaImage(m_overlay_image, flow::Mode(m_flow_mode));
+    m_tex_stream_area = update_texture(m_tex_stream_area, 0, m_overlay_image);
+
+    return 0;
+}
+
+int Viewer::update_shading()
+{
+    m_hf->ShadingImage(m_overlay_image, m_shading_dir, m_output_dim, m_output_dim);
+    m_tex_shading = update_texture(m_tex_shading, 0, m_overlay_image);
+
+    return 0;
+}
+
+int Viewer::generate_elevations()
+{
+    //! Noise only, the elevation PNG is written by export_maps() when asked for
+    m_elevations.resize(m_hf_dim * m_hf_dim);
+    znoise::fill_hmf(m_elevations, m_scale, m_hf_dim, m_hf_dim, m_hurst, m_lacunarity, m_base_scale, m_offset[0], m_offset[1], m_seed, 0, m_octaves);
+
+    return 0;
+}
+
+int Viewer::export_maps()
+{
+    m_hf->ExportElevation("elevation.png", m_output_dim, m_output_dim);
     m_hf->ExportGradient("gradient.png", m_output_dim, m_output_dim);
     m_hf->ExportLaplacian("laplacian.png", m_output_dim, m_output_dim);
     m_hf->ExportNormal("normal.png", m_output_dim, m_output_dim);
     m_hf->ExportSlope("slope.png", m_output_dim, m_output_dim);
     m_hf->ExportAverageSlope("avgslope.png", m_output_dim, m_output_dim);
     m_hf->ExportShading("shading.png", m_shading_dir, m_output_dim, m_output_dim);
-    m_hf->ExportStreamArea("streamarea.png");
-
-    m_tex_elevation = read_texture(0, std::string(DATA_DIR) + "/output/elevation.png");
-    m_tex_gradient = read_texture(0, std::string(DATA_DIR) + "/output/gradient.png");
-    m_tex_laplacian = read_texture(0, std::string(DATA_DIR) + "/output/laplacian.png");
-    m_tex_normal = read_texture(0, std::string(DATA_DIR) + "/output/normal.png");
-    m_tex_slope = read_texture(0, std::string(DATA_DIR) + "/output/slope.png");
-    m_tex_avg_slope = read_texture(0, std::string(DATA_DIR) + "/output/avgslope.png");
-    m_tex_shading = read_texture(0, std::string(DATA_DIR) + "/output/shading.png");
-    m_tex_stream_area = read_texture(0, std::string(DATA_DIR) + "/output/streamarea.png");
+    m_hf->ExportStreamArea("streamarea.png", flow::Mode(m_flow_mode));
 
     return 0;
 }
@@ -322,7 +440,7 @@ int Viewer::erode()
     {
         Timer timer;
         timer.start();
-        m_hf->StreamPower();
+        m_hf->StreamPower(m_uplift, m_erodibility, m_area_exponent, m_slope_exponent, m_dt);
         timer.stop();
         m_streampower_ms += timer.ms();
         m_streampower_us += timer.us();
@@ -350,7 +468,7 @@ int Viewer::smooth()
 {
     Timer timer;
     timer.start();
-    m_hf->Smooth();
+    m_hf->Smooth(m_smooth_iterations);
     timer.stop();
 
     m_smooth_ms += timer.ms();
@@ -371,17 +489,22 @@ int Viewer::render_scalar_field_params()
     }
     ImGui::SliderInt("Output Dim", &m_output_dim, 16.f, 2048.f);
     ImGui::SliderInt("Resolution", &m_resolution, m_hf_dim / 4, m_hf_dim * 8);
+    if (ImGui::Checkbox("Adaptive mesh", &m_adaptive))
+        update_height_field();
+    if (m_adaptive && ImGui::SliderFloat("Max error", &m_adaptive_error, 0.01f, 10.f, "%.2f", ImGuiSliderFlags_Logarithmic))
+        update_height_field();
     ImGui::SliderInt("Map dim", &m_map_dim, 16, 2048);
     if (ImGui::CollapsingHeader("Perlin Noise"))
     {
         ImGui::SliderFloat("Hurst", &m_hurst, 0.01f, 5.0f);
         ImGui::SliderFloat("Lacunarity", &m_lacunarity, 1.f, 15.f);
+        ImGui::SliderFloat("Octaves", &m_octaves, 1.f, 16.f);
         if (ImGui::InputInt("Seed", &m_seed))
         {
-            m_elevations = znoise::generate_hmf("elevation.png", m_scale, m_hf_dim, m_hf_dim, m_hurst, m_lacunarity, m_base_scale, m_offset[0], m_offset[1], m_seed);
+            generate_elevations();
 
             m_hf->Elevations(m_elevations, m_hf_dim, m_hf_dim);
-            update_height_field(false);
+            update_height_field();
         }
         ImGui::SliderInt2("Offset XY", &m_offset[0], -2048, 2048);
         ImGui::SliderFloat("Base Scale", &m_base_scale, 0.001f, 1.f);
@@ -390,8 +513,21 @@ int Viewer::render_scalar_field_params()
     ImGui::SliderFloat3("Model Scale", &m_object_scale.x, 1.f, 100.f);
     if (ImGui::SliderFloat3("Shading Direction", &m_shading_dir.x, -1.f, 1.f))
     {
-        m_hf->ExportShading("shading.png", m_shading_dir, m_output_dim, m_output_dim);
-        m_tex_shading = read_texture(0, std::string(DATA_DIR) + "/output/shading.png");
+        update_shading();
+    }
+
+    if (ImGui::Combo("Flow routing", &m_flow_mode, "D8\0MFD\0D-infinity\0"))
+    {
+        update_stream_area();
+    }
+
+    if (ImGui::CollapsingHeader("Stream power"))
+    {
+        ImGui::SliderFloat("Uplift", &m_uplift, 0.f, 1.f);
+        ImGui::SliderFloat("Erodibility", &m_erodibility, 0.001f, 10.f, "%.3f", ImGuiSliderFlags_Logarithmic);
+        ImGui::SliderFloat("m", &m_area_exponent, 0.1f, 1.f);
+        ImGui::SliderFloat("n", &m_slope_exponent, 0.5f, 2.f);
+        ImGui::SliderFloat("dt", &m_dt, 0.01f, 1000.f, "%.2f", ImGuiSliderFlags_Logarithmic);
     }
 
     if (ImGui::Button("Erode (b)"))
@@ -410,6 +546,7 @@ int Viewer::render_scalar_field_params()
     }
     ImGui::PopID();
 
+    ImGui::SliderInt("Smooth iterations", &m_smooth_iterations, 1, 64);
     if (ImGui::Button("Smooth (n)"))
         smooth();
 
@@ -422,26 +559,40 @@ int Viewer::render_scalar_field_params()
 
     if (ImGui::Button("Generate (g)"))
     {
-        m_elevations = znoise::generate_hmf("elevation.png", m_scale, m_hf_dim, m_hf_dim, m_hurst, m_lacunarity, m_base_scale, m_offset[0], m_offset[1], m_seed);
+        generate_elevations();
         // m_elevations = mmv::load_elevation("montblanc.png");
 
         m_hf->Elevations(m_elevations, m_hf_dim, m_hf_dim);
-        update_height_field(false);
+        update_height_field();
     }
 
     if (ImGui::Button("Center camera"))
     {
-        m_height_map.bounds(pmin, pmax);
+        update_bounds();
         pmin = {pmin.x * m_object_scale.x, pmin.y * m_object_scale.y, pmin.z * m_object_scale.z};
         pmax = {pmax.x * m_object_scale.x, pmax.y * m_object_scale.y, pmax.z * m_object_scale.z};
         m_cs.orbiter().lookat(pmin, pmax);
     }
 
+    ImGui::SeparatorText("Export maps");
+    if (ImGui::Button("Export maps (PNG)"))
+    {
+        export_maps();
+    }
+
     ImGui::SeparatorText("Export HF");
     ImGui::InputTextWithHint("Filename (OBJ)", "my_hf", &m_filename);
+    ImGui::Checkbox("Decimate (QEM)", &m_decimate_export);
+    if (m_decimate_export && ImGui::InputInt("Max triangles", &m_export_triangles, 10000, 100000))
+        m_export_triangles = std::max(m_export_triangles, 2);
     if (ImGui::Button("Export"))
     {
-        m_hf->ExportObj(m_filename, m_resolution);
+        if (m_decimate_export)
+            m_hf->ExportObj(m_filename, m_resolution, mmv::DECIMATED_MESH, 0.f, std::size_t(m_export_triangles));
+        else if (m_adaptive)
+            m_hf->ExportObj(m_filename, m_resolution, mmv::ADAPTIVE_MESH, m_adaptive_error);
+        else
+            m_hf->ExportObj(m_filename, m_resolution);
     }
 
     return 0;
@@ -473,6 +624,7 @@ int Viewer::save_params()
     file << m_shading_dir.x << ' ' << m_shading_dir.y << ' ' << m_shading_dir.z << '\n';
 
     file << m_overlay << '\n';
+    file << m_octaves << '\n';
 
     file.close();
     return 0;
@@ -513,6 +665,9 @@ int Viewer::load_params()
 
     m_overlay = (OVERLAY_TEX)overlay;
 
+    //! Missing from older files, the default is kept then
+    file >> m_octaves;
+
     file.close();
     return 0;
 }
@@ -566,10 +721,10 @@ int Viewer::handle_event()
         if (key_state(SDLK_g))
         {
             clear_key_state(SDLK_g);
-            m_elevations = znoise::generate_hmf("elevation.png", m_scale, m_hf_dim, m_hf_dim, m_hurst, m_lacunarity, m_base_scale, m_offset[0], m_offset[1], m_seed);
+            generate_elevations();
 
             m_hf->Elevations(m_elevations, m_hf_dim, m_hf_dim);
-            update_height_field(false);
+            update_height_field();
         }
 
         float dt = delta_time() / 1000.f;
@@ -807,6 +962,11 @@ int Viewer::render_ui()
             ImGui::SameLine();
             ImGui::Checkbox("Points (v)", &m_show_points);
 
+            if (ImGui::Checkbox("Level of detail", &m_lod) && m_lod)
+                m_terrain.Build(*m_hf);
+            if (m_lod)
+                ImGui::SliderFloat("Pixel error", &m_lod_pixel_error, 0.5f, 16.f, "%.1f");
+
             if (ImGui::CollapsingHeader("Colors"))
             {
                 ImGui::ColorPicker3("Clear color", &m_clear_color[0]);
@@ -830,8 +990,13 @@ int Viewer::render_ui()
         ImGui::Text("gpu : %i ms %i us", gpums, gpuus);
         ImGui::Text("frame rate : %.2f ms", delta_time());
         ImGui::SeparatorText("Geometry");
-        ImGui::Text("#Triangle : %i ", ((m_resolution - 1) * 2) * ((m_resolution - 1) * 2));
-        ImGui::Text("#Vertex : %i ", m_height_map.vertex_count());
+        ImGui::Text("#Triangle : %i ", m_index_count / 3);
+        ImGui::Text("#Vertex : %i ", int(m_positions.size() / 3));
+        if (m_lod)
+        {
+            ImGui::Text("#LOD Chunk : %i (%i cached)", int(m_terrain.Selection().size()), m_terrain.CachedCount());
+            ImGui::Text("#LOD Triangle : %i ", m_terrain.TriangleCount());
+        }
         ImGui::SeparatorText("Height Field");
         ImGui::Text("Map Width : %i ", m_hf->Nx());
         ImGui::Text("Map Height : %i ", m_hf->Ny());
@@ -1,5 +1,6 @@
 #include "ZNoise.h"
 
+#include "Parallel.h"
 #include "Utils.h"
 
 namespace mmv
@@ -124,291 +125,225 @@ namespace mmv
 
 namespace znoise
 {
-    std::vector<float> generate_perlin(const std::string &filename, float scale, int width, int height)
+    namespace
     {
-        Perlin perlin;
-        perlin.Shuffle(10);
-
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int r = 0; r < height; ++r)
+        //! Map raw noise in [-1, 1] to elevations in [0, scale]
+        void remap(float *row, int width, float scale)
         {
             for (int i = 0; i < width; ++i)
-            {
-                float h = perlin.Get({(float)i, (float)r}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
+                row[i] = (row[i] + 1.f) * 0.5f * scale;
+        }
 
-                elevations[r * width + i] = (h + 1.f) * 0.5f * scale;
+        //! Sample a 2D noise on every row, one Fill per row
+        template <typename Noise>
+        void fill_2d(const Noise &noise, std::span<float> elevations, float scale, int width, int height)
+        {
+            assert(elevations.size() == std::size_t(width) * height);
 
-                image.pixels[(r * width + i) * 3 + 0] = value;
-                image.pixels[(r * width + i) * 3 + 1] = value;
-                image.pixels[(r * width + i) * 3 + 2] = value;
+            for (int j = 0; j < height; ++j)
+            {
+                float *row = elevations.data() + j * width;
+                noise.Fill(std::span<float>(row, width), 0.f, (float)j, 1.f, 0.f, 0.01f);
+                remap(row, width, scale);
             }
         }
 
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_perlin] Image ", filename, " successfully saved in ./data/output");
+        //! Sample a 3D or 4D slice per cell, coords(i, j) gives the coordinates list
+        template <typename Noise, typename Coordinates>
+        void fill_slice(const Noise &noise, std::span<float> elevations, float scale, int width, int height, Coordinates coords)
+        {
+            assert(elevations.size() == std::size_t(width) * height);
 
-        return elevations;
-    }
+            for (int j = 0; j < height; ++j)
+                for (int i = 0; i < width; ++i)
+                    elevations[j * width + i] = (coords(noise, (float)i, (float)j) + 1.f) * 0.5f * scale;
+        }
 
-    std::vector<float> generate_perlin_3dslice(const std::string &filename, float scale, int width, int height)
-    {
-        Perlin perlin;
-        perlin.Shuffle(10);
+        //! Run a mixer on the rows, in parallel, output only depends on the seed
+        template <typename Mixer>
+        void fill_mixer(const Mixer &mixer, std::span<float> elevations, float scale, int width, int height, float baseScale, int x_offset, int y_offset, int threads)
+        {
+            assert(elevations.size() == std::size_t(width) * height);
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+            parallel_for(0, height, [&](int first, int last) {
+                for (int j = first; j < last; ++j)
+                {
+                    float *row = elevations.data() + j * width;
+                    mixer.Fill(std::span<float>(row, width), (float)x_offset, (float)j + y_offset, 1.f, 0.f, baseScale);
+                    remap(row, width, scale);
+                }
+            }, threads);
+        }
 
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
+        Simplex seeded_simplex(unsigned int seed)
+        {
+            Simplex simplex;
+            simplex.SetSeed(seed);
+            simplex.Shuffle(10);
+            return simplex;
+        }
 
-        for (int r = 0; r < height; ++r)
+        //! Generate into a new buffer and write it through the image sink, the historical behaviour
+        template <typename Fill>
+        std::vector<float> generate_and_write(const std::string &filename, const char *name, float scale, int width, int height, Fill fill)
         {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = perlin.Get({(float)i, (float)r, 0.0f}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
+            std::vector<float> elevations(width * height);
+            fill(std::span<float>(elevations));
 
-                elevations[r * width + i] = (h + 1.f) * 0.5f * scale;
+            if (write_elevation_image(filename, elevations, width, height, scale) == 0)
+                utils::status("[", name, "] Image ", filename, " successfully saved in ./data/output");
 
-                image.pixels[(r * width + i) * 3 + 0] = value;
-                image.pixels[(r * width + i) * 3 + 1] = value;
-                image.pixels[(r * width + i) * 3 + 2] = value;
-            }
+            return elevations;
         }
+    } // namespace
 
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_perlin_3dslice] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+    void fill_perlin(std::span<float> elevations, float scale, int width, int height)
+    {
+        Perlin perlin;
+        perlin.Shuffle(10);
+        fill_2d(perlin, elevations, scale, width, height);
     }
 
-    std::vector<float> generate_perlin_4dslice(const std::string &filename, float scale, int width, int height)
+    void fill_perlin_3dslice(std::span<float> elevations, float scale, int width, int height)
     {
         Perlin perlin;
         perlin.Shuffle(10);
+        fill_slice(perlin, elevations, scale, width, height, [](const Perlin &p, float x, float y) { return p.Get({x, y, 0.0f}, 0.01f); });
+    }
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int r = 0; r < height; ++r)
-        {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = perlin.Get({(float)i, (float)r, 0.0f, 1.0f}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
-
-                elevations[r * width + i] = (h + 1.f) * 0.5f * scale;
-
-                image.pixels[(r * width + i) * 3 + 0] = value;
-                image.pixels[(r * width + i) * 3 + 1] = value;
-                image.pixels[(r * width + i) * 3 + 2] = value;
-            }
-        }
-
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_perlin_4dslice] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+    void fill_perlin_4dslice(std::span<float> elevations, float scale, int width, int height)
+    {
+        Perlin perlin;
+        perlin.Shuffle(10);
+        fill_slice(perlin, elevations, scale, width, height, [](const Perlin &p, float x, float y) { return p.Get({x, y, 0.0f, 1.0f}, 0.01f); });
     }
 
-    std::vector<float> generate_simplex(const std::string &filename, float scale, int width, int height)
+    void fill_simplex(std::span<float> elevations, float scale, int width, int height)
     {
         Simplex simplex;
         simplex.Shuffle(10);
-
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int j = 0; j < height; ++j)
-        {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = simplex.Get({(float)i, (float)j}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
-
-                elevations[j * width + i] = (h + 1.f) * 0.5f * scale;
-
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
-        }
-
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_simplex] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+        fill_2d(simplex, elevations, scale, width, height);
     }
 
-    std::vector<float> generate_simplex_3dslice(const std::string &filename, float scale, int width, int height)
+    void fill_simplex_3dslice(std::span<float> elevations, float scale, int width, int height)
     {
         Simplex simplex;
         simplex.Shuffle(10);
-
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int j = 0; j < height; ++j)
-        {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = simplex.Get({(float)i, (float)j, 1.0f}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
-
-                elevations[j * width + i] = (h + 1.f) * 0.5f * scale;
-
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
-        }
-
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_simplex_3dslice] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+        fill_slice(simplex, elevations, scale, width, height, [](const Simplex &s, float x, float y) { return s.Get({x, y, 1.0f}, 0.01f); });
     }
 
-    std::vector<float> generate_simplex_4dslice(const std::string &filename, float scale, int width, int height)
+    void fill_simplex_4dslice(std::span<float> elevations, float scale, int width, int height)
     {
         Simplex simplex;
         simplex.Shuffle(10);
-
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int j = 0; j < height; ++j)
-        {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = simplex.Get({(float)i, (float)j, 1.0f, 2.0f}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
-
-                elevations[j * width + i] = (h + 1.f) * 0.5f * scale;
-
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
-        }
-
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_simplex_4dslice] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+        fill_slice(simplex, elevations, scale, width, height, [](const Simplex &s, float x, float y) { return s.Get({x, y, 1.0f, 2.0f}, 0.01f); });
     }
 
-    std::vector<float> generate_worley(const std::string &filename, float scale, int width, int height, WorleyFunction worleyFunc)
+    void fill_worley(std::span<float> elevations, float scale, int width, int height, WorleyFunction worleyFunc)
     {
         Worley worley;
         worley.Shuffle(10);
+        fill_2d(worley, elevations, scale, width, height);
+    }
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
-
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
-
-        for (int j = 0; j < height; ++j)
+    void fill_hmf(std::span<float> elevations, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed, int threads, float octaves)
+    {
+        const Simplex simplex = seeded_simplex(seed);
+
+        //! Specialised mixer for the common octave counts, the runtime one otherwise
+        const bool integral = (octaves == std::floor(octaves));
+        if (!integral || !DispatchOctaves(int(octaves), [&](auto n) {
+                HybridMultiFractalT<Simplex, decltype(n)::value> hmf(simplex);
+                hmf.SetParameters(hurst, lacunarity);
+                fill_mixer(hmf, elevations, scale, width, height, baseScale, x_offset, y_offset, threads);
+            }))
         {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = worley.Get({(float)i, (float)j}, 0.01f);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
-
-                elevations[j * width + i] = (h + 1.f) * 0.5f * scale;
-
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
+            HybridMultiFractal hmf(simplex);
+            hmf.SetParameters(hurst, lacunarity, octaves);
+            fill_mixer(hmf, elevations, scale, width, height, baseScale, x_offset, y_offset, threads);
         }
-
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_worley] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
     }
 
-    std::vector<float> generate_hmf(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed)
+    void fill_fbm(std::span<float> elevations, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed, int threads, float octaves)
     {
-        Simplex simplex;
-        simplex.SetSeed(seed);
-        simplex.Shuffle(10);
+        const Simplex simplex = seeded_simplex(seed);
+
+        //! Specialised mixer for the common octave counts, the runtime one otherwise
+        const bool integral = (octaves == std::floor(octaves));
+        if (!integral || !DispatchOctaves(int(octaves), [&](auto n) {
+                FBMT<Simplex, decltype(n)::value> fbm(simplex);
+                fbm.SetParameters(hurst, lacunarity);
+                fill_mixer(fbm, elevations, scale, width, height, baseScale, x_offset, y_offset, threads);
+            }))
+        {
+            FBM fbm(simplex);
+            fbm.SetParameters(hurst, lacunarity, octaves);
+            fill_mixer(fbm, elevations, scale, width, height, baseScale, x_offset, y_offset, threads);
+        }
+    }
 
-        HybridMultiFractal hmf(simplex);
-        hmf.SetParameters(hurst, lacunarity, 5.f);
+    int write_elevation_image(const std::string &filename, std::span<const float> elevations, int width, int height, float scale)
+    {
+        assert(elevations.size() == std::size_t(width) * height);
 
         std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
 
-        std::vector<float> elevations(width * height);
         ImageData image(width, height, 3);
-
-        for (int j = 0; j < height; ++j)
+        for (int k = 0; k < width * height; ++k)
         {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = (hmf.Get({(float)i + x_offset, (float)j + y_offset}, baseScale) + 1.0f) * 0.5f;
-                auto value = static_cast<unsigned char>(h * 255.f);
-
-                elevations[j * width + i] = h * scale;
+            auto value = static_cast<unsigned char>(std::clamp(elevations[k] / scale, 0.f, 1.f) * 255.f);
 
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
+            image.pixels[k * 3 + 0] = value;
+            image.pixels[k * 3 + 1] = value;
+            image.pixels[k * 3 + 2] = value;
         }
 
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_hmf] Image ", filename, " successfully saved in ./data/output");
-
-        return elevations;
+        return write_image_data(image, fullpath.c_str());
     }
 
-    std::vector<float> generate_fbm(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed)
+    std::vector<float> generate_perlin(const std::string &filename, float scale, int width, int height)
     {
-        Simplex simplex;
-        simplex.SetSeed(seed);
-        simplex.Shuffle(10);
+        return generate_and_write(filename, "generate_perlin", scale, width, height, [&](std::span<float> e) { fill_perlin(e, scale, width, height); });
+    }
 
-        FBM fbm(simplex);
-        fbm.SetParameters(hurst, lacunarity, 5.f);
+    std::vector<float> generate_perlin_3dslice(const std::string &filename, float scale, int width, int height)
+    {
+        return generate_and_write(filename, "generate_perlin_3dslice", scale, width, height, [&](std::span<float> e) { fill_perlin_3dslice(e, scale, width, height); });
+    }
 
-        std::string fullpath = std::string(DATA_DIR) + "/output/" + filename;
+    std::vector<float> generate_perlin_4dslice(const std::string &filename, float scale, int width, int height)
+    {
+        return generate_and_write(filename, "generate_perlin_4dslice", scale, width, height, [&](std::span<float> e) { fill_perlin_4dslice(e, scale, width, height); });
+    }
 
-        std::vector<float> elevations(width * height);
-        ImageData image(width, height, 3);
+    std::vector<float> generate_simplex(const std::string &filename, float scale, int width, int height)
+    {
+        return generate_and_write(filename, "generate_simplex", scale, width, height, [&](std::span<float> e) { fill_simplex(e, scale, width, height); });
+    }
 
-        for (int j = 0; j < height; ++j)
-        {
-            for (int i = 0; i < width; ++i)
-            {
-                float h = fbm.Get({(float)i + x_offset, (float)j + y_offset}, baseScale);
-                auto value = static_cast<unsigned char>((h + 1.f) * 0.5f * 255.f);
+    std::vector<float> generate_simplex_3dslice(const std::string &filename, float scale, int width, int height)
+    {
+        return generate_and_write(filename, "generate_simplex_3dslice", scale, width, height, [&](std::span<float> e) { fill_simplex_3dslice(e, scale, width, height); });
+    }
 
-                elevations[j * width + i] = (h + 1.f) * 0.5f * scale;
+    std::vector<float> generate_simplex_4dslice(const std::string &filename, float scale, int width, int height)
+    {
+        return generate_and_write(filename, "generate_simplex_4dslice", scale, width, height, [&](std::span<float> e) { fill_simplex_4dslice(e, scale, width, height); });
+    }
 
-                image.pixels[(j * width + i) * 3 + 0] = value;
-                image.pixels[(j * width + i) * 3 + 1] = value;
-                image.pixels[(j * width + i) * 3 + 2] = value;
-            }
-        }
+    std::vector<float> generate_worley(const std::string &filename, float scale, int width, int height, WorleyFunction worleyFunc)
+    {
+        return generate_and_write(filename, "generate_worley", scale, width, height, [&](std::span<float> e) { fill_worley(e, scale, width, height, worleyFunc); });
+    }
 
-        write_image_data(image, fullpath.c_str());
-        utils::status("[generate_fbm] Image ", filename, " successfully saved in ./data/output");
+    std::vector<float> generate_hmf(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed, int threads, float octaves)
+    {
+        return generate_and_write(filename, "generate_hmf", scale, width, height, [&](std::span<float> e) { fill_hmf(e, scale, width, height, hurst, lacunarity, baseScale, x_offset, y_offset, seed, threads, octaves); });
+    }
 
-        return elevations;
+    std::vector<float> generate_fbm(const std::string &filename, float scale, int width, int height, float hurst, float lacunarity, float baseScale, int x_offset, int y_offset, unsigned int seed, int threads, float octaves)
+    {
+        return generate_and_write(filename, "generate_fbm", scale, width, height, [&](std::span<float> e) { fill_fbm(e, scale, width, height, hurst, lacunarity, baseScale, x_offset, y_offset, seed, threads, octaves); });
     }
 
 } // namespace znoise
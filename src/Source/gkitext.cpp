@@ -63,6 +63,38 @@ GLuint read_texture(const int unit, const std::string &texture)
     return read_texture(unit, texture.c_str());
 }
 
+GLuint update_texture(GLuint texture, const int unit, const ImageData &image)
+{
+    if (image.pixels.empty())
+        return texture;
+
+    GLint width = 0, height = 0;
+    if (texture > 0)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    }
+
+    //! Same dimensions: only transfer the pixels
+    if (texture > 0 && width == image.width && height == image.height && image.size == 1)
+    {
+        GLenum format = image.channels == 4 ? GL_RGBA : GL_RGB;
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, format, GL_UNSIGNED_BYTE, image.data());
+        glGenerateMipmap(GL_TEXTURE_2D);
+        return texture;
+    }
+
+    if (texture > 0)
+        glDeleteTextures(1, &texture);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    return make_texture(unit, image);
+}
+
 Image read_image(const std::string &image)
 {
     return read_image(image.c_str());